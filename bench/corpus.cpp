@@ -0,0 +1,679 @@
+// Copyright (c) 2020 stillwwater
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+// End to end throughput of the pocdoc tool on generated corpora from 1k
+// to 1M lines. Fails if time grows faster than the input, if throughput
+// falls below a recorded baseline, if peak memory grows with the number
+// of files, or if the golden files in test/ no longer match.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <csignal>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "synth.h"
+
+static const char *Usage =
+"pocdoc-corpus [options]\n\n"
+"options:\n"
+"  -pocdoc path         The pocdoc binary to run (build/pocdoc)\n"
+"  -j jobs              Jobs passed to pocdoc (1)\n"
+"  -runs N              Runs of each corpus, the fastest is kept (3)\n"
+"  -max-lines N         Lines in the largest corpus (1000000)\n"
+"  -max-growth x        Most the time per line may grow between one\n"
+"                       corpus and the next larger one (1.5)\n"
+"  -baseline path       Lines per second to compare with, a missing\n"
+"                       file fails and an empty one skips the\n"
+"                       comparison (bench/baseline.txt)\n"
+"  -margin percent      How far below the baseline a corpus may be (15)\n"
+"  -max-files N         Most copies of one header built at once when\n"
+"                       checking peak RSS stays flat (10000)\n"
+"  -rss-margin percent  How far peak RSS may grow from 10 files (20)\n"
+"  -write-baseline path Record this run's throughput as the baseline\n"
+"  -golden dir          Directory with golden test.h.md and vec.h.md\n"
+"                       next to their headers (test)\n"
+"  -o out.json          Write results to a file as well\n";
+
+struct CorpusOptions {
+	std::string pocdoc = "build/pocdoc";
+	int jobs = 1;
+	int runs = 3;
+	size_t max_lines = 1000000;
+	double max_growth = 1.5;
+	std::string baseline = "bench/baseline.txt";
+	int margin = 15;
+	size_t max_files = 10000;
+	int rss_margin = 20;
+	std::string write_baseline;
+	std::string golden = "test";
+	std::string output;
+};
+
+// Generated headers of one measurement
+struct Corpus {
+	std::string name;
+	std::string dir;
+	std::vector<std::string> files;
+	size_t lines = 0;
+	// Whether it is one of the corpora scaled by total lines, which are
+	// compared with each other for growth.
+	bool scaled = false;
+	// A single large header, held to the growth of the largest scaled
+	// corpus it isn't bigger than.
+	bool single = false;
+	// Options passed to pocdoc for this corpus
+	std::vector<std::string> args;
+	// Corpus whose files this one builds again with other options
+	std::string variant_of;
+};
+
+struct Measurement {
+	double seconds = 0;
+	long peak_rss_kb = 0;
+};
+
+// Lines in a file of the scaled corpora, headers are usually smaller
+// than this but generating fewer files keeps argv manageable.
+constexpr size_t FileLines = 2000;
+
+size_t count_lines(const std::string &text) {
+	return size_t(std::count(text.begin(), text.end(), '\n'));
+}
+
+bool write_file(const std::string &path, const std::string &text) {
+	std::ofstream file{path, std::ios::binary};
+	file << text;
+	return bool(file);
+}
+
+// Adds a header of at least the given lines to the corpus.
+bool add_header(Corpus &corpus, SynthOptions synth, size_t lines) {
+	// Lines per declaration depend on the shape, so the first header
+	// only measures it.
+	synth.decls = std::max<size_t>(1, lines / 3);
+	synth.seed = corpus.files.size() + 1;
+	auto text = synth_header(synth);
+	synth.decls = std::max<size_t>(1, synth.decls * lines / count_lines(text));
+	text = synth_header(synth);
+	while (count_lines(text) < lines) {
+		synth.decls += synth.decls / 100 + 1;
+		text = synth_header(synth);
+	}
+	auto path = corpus.dir + "/h" + std::to_string(corpus.files.size()) + ".h";
+	if (!write_file(path, text)) {
+		return false;
+	}
+	corpus.files.push_back(path);
+	corpus.lines += count_lines(text);
+	return true;
+}
+
+// A corpus of one header that is a single class with members members
+bool generate_class(Corpus &corpus, const std::string &root,
+                    SynthOptions synth, size_t members) {
+	corpus.dir = root + "/" + corpus.name;
+	if (mkdir(corpus.dir.c_str(), 0755) != 0) {
+		return false;
+	}
+	synth.members = members;
+	synth.decls = members + 1;
+	auto text = synth_header(synth);
+	auto path = corpus.dir + "/h0.h";
+	if (!write_file(path, text)) {
+		return false;
+	}
+	corpus.files.push_back(path);
+	corpus.lines = count_lines(text);
+	return true;
+}
+
+bool generate(Corpus &corpus, const std::string &root, size_t lines,
+              const SynthOptions &synth, size_t file_lines) {
+	corpus.dir = root + "/" + corpus.name;
+	if (mkdir(corpus.dir.c_str(), 0755) != 0) {
+		return false;
+	}
+	while (corpus.lines < lines) {
+		auto remaining = lines - corpus.lines;
+		if (!add_header(corpus, synth, std::min(remaining, file_lines))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Starts pocdoc in dir with its output discarded, -1 on failure.
+pid_t start_pocdoc(const std::string &pocdoc, const std::string &dir,
+                   const std::vector<std::string> &args) {
+	std::vector<char *> argv;
+	argv.push_back(const_cast<char *>(pocdoc.c_str()));
+	for (const auto &arg : args) {
+		argv.push_back(const_cast<char *>(arg.c_str()));
+	}
+	argv.push_back(nullptr);
+
+	// Anything buffered would be written again by the child
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (dir != "" && chdir(dir.c_str()) != 0) {
+			_exit(127);
+		}
+		// pocdoc's verbose output isn't part of the measurement
+		if (freopen("/dev/null", "w", stdout) == nullptr) {
+			_exit(127);
+		}
+		execv(argv[0], argv.data());
+		_exit(127);
+	}
+	return pid;
+}
+
+// Runs pocdoc in dir and waits for it, rusage of the child gives its
+// peak RSS including libclang.
+bool run_pocdoc(const std::string &pocdoc, const std::string &dir,
+                const std::vector<std::string> &args, Measurement &result) {
+	auto start = std::chrono::steady_clock::now();
+	pid_t pid = start_pocdoc(pocdoc, dir, args);
+	if (pid < 0) {
+		return false;
+	}
+	int status = 0;
+	rusage usage{};
+	if (wait4(pid, &status, 0, &usage) != pid) {
+		return false;
+	}
+	std::chrono::duration<double> took =
+		std::chrono::steady_clock::now() - start;
+	result.seconds = took.count();
+	result.peak_rss_kb = usage.ru_maxrss;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Peak RSS of building the same header copied to 10, 100 and up to
+// max_files files. Translation units are freed once their header is
+// written, so memory should not depend on how many files a run has.
+bool check_rss(const CorpusOptions &options, const std::string &root,
+               const std::string &out_dir,
+               std::vector<std::pair<size_t, long>> &peaks) {
+	auto dir = root + "/rss";
+	SynthOptions synth;
+	synth.decls = 40;
+	auto text = synth_header(synth);
+	if (mkdir(dir.c_str(), 0755) != 0) {
+		return false;
+	}
+	// Names are relative to dir, 10000 absolute paths would be long
+	std::vector<std::string> args{"-o", out_dir,
+	                              "-j", std::to_string(options.jobs)};
+	bool ok = true;
+	for (size_t files = 10; files <= options.max_files; files *= 10) {
+		while (args.size() - 4 < files) {
+			auto name = "h" + std::to_string(args.size() - 4) + ".h";
+			if (!write_file(dir + "/" + name, text)) {
+				return false;
+			}
+			args.push_back(name);
+		}
+		Measurement result;
+		if (!run_pocdoc(options.pocdoc, dir, args, result)) {
+			fprintf(stderr, "error: pocdoc failed on %zu copies\n", files);
+			return false;
+		}
+		printf("rss %6zu files %10ld kB\n", files, result.peak_rss_kb);
+		fflush(stdout);
+		peaks.emplace_back(files, result.peak_rss_kb);
+
+		long limit = peaks[0].second * (100 + options.rss_margin) / 100;
+		if (result.peak_rss_kb > limit) {
+			printf("error: peak RSS grew from %ld kB with %zu files to "
+			       "%ld kB with %zu\n", peaks[0].second, peaks[0].first,
+			       result.peak_rss_kb, files);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+bool measure(const CorpusOptions &options, const std::string &out_dir,
+             const Corpus &corpus, Measurement &best) {
+	std::vector<std::string> args{"-o", out_dir,
+	                              "-j", std::to_string(options.jobs)};
+	args.insert(args.end(), corpus.args.begin(), corpus.args.end());
+	args.insert(args.end(), corpus.files.begin(), corpus.files.end());
+	for (int run = 0; run < options.runs; ++run) {
+		Measurement result;
+		if (!run_pocdoc(options.pocdoc, "", args, result)) {
+			fprintf(stderr, "error: pocdoc failed on %s\n",
+			        corpus.name.c_str());
+			return false;
+		}
+		if (run == 0 || result.seconds < best.seconds) {
+			best.seconds = result.seconds;
+		}
+		best.peak_rss_kb = std::max(best.peak_rss_kb, result.peak_rss_kb);
+	}
+	return true;
+}
+
+bool load_baseline(const std::string &path,
+                   std::map<std::string, double> &baseline) {
+	std::ifstream file{path};
+	if (!file) {
+		return false;
+	}
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		std::istringstream fields{line};
+		std::string name;
+		double lines_per_second = 0;
+		if (fields >> name >> lines_per_second) {
+			baseline[name] = lines_per_second;
+		}
+	}
+	return true;
+}
+
+bool read_file(const std::string &path, std::string &text) {
+	std::ifstream file{path, std::ios::binary};
+	std::ostringstream stream;
+	stream << file.rdbuf();
+	text = stream.str();
+	return bool(file);
+}
+
+// Watch mode builds every header, then waits for edits until it is
+// interrupted. Interrupts are handled once outputs appear, and only
+// end it after the first builds.
+bool run_watch(const std::string &pocdoc, const std::string &dir,
+               const std::vector<std::string> &args,
+               const std::vector<std::string> &outputs) {
+	pid_t pid = start_pocdoc(pocdoc, dir, args);
+	if (pid < 0) {
+		return false;
+	}
+	int status = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (;;) {
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			return false;
+		}
+		bool written = true;
+		for (const auto &output : outputs) {
+			written = written && access(output.c_str(), F_OK) == 0;
+		}
+		if (written) {
+			break;
+		}
+		if (std::chrono::steady_clock::now() - start
+		    > std::chrono::seconds(60)) {
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			return false;
+		}
+		usleep(10000);
+	}
+	kill(pid, SIGINT);
+	if (waitpid(pid, &status, 0) != pid) {
+		return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Builds the golden headers where they are, so titles and anonymous
+// names carry the same file names as the checked in markdown.
+bool check_golden(const CorpusOptions &options, const std::string &out_dir) {
+	// Comments attached by libclang must find the same documentation
+	// as the heuristic. Watch mode parses each header on its own even
+	// with -umbrella.
+	const std::vector<std::string> modes[] = {
+		{}, {"-raw-comments"}, {"-watch", "-umbrella"},
+	};
+	const char *files[] = {"test.h.md", "vec.h.md"};
+	bool ok = true;
+	for (const auto &mode : modes) {
+		std::string label;
+		std::vector<std::string> outputs;
+		for (const auto &arg : mode) {
+			label += " " + arg;
+		}
+		for (const char *file : files) {
+			outputs.push_back(out_dir + "/" + file);
+			unlink(outputs.back().c_str());
+		}
+		auto args = mode;
+		args.insert(args.end(), {"-o", out_dir, "test.h", "vec.h"});
+		Measurement ignored;
+		bool watch = std::find(mode.begin(), mode.end(), "-watch")
+		           != mode.end();
+		if (watch ? !run_watch(options.pocdoc, options.golden, args, outputs)
+		          : !run_pocdoc(options.pocdoc, options.golden, args,
+		                        ignored)) {
+			fprintf(stderr, "error: pocdoc%s failed on the golden headers\n",
+			        label.c_str());
+			return false;
+		}
+		for (const char *file : files) {
+			auto name = file + label;
+			std::string expected, actual;
+			if (!read_file(options.golden + "/" + file, expected)
+			    || !read_file(out_dir + "/" + file, actual)) {
+				fprintf(stderr, "error: could not read %s\n", file);
+				ok = false;
+				continue;
+			}
+			if (expected == actual) {
+				printf("golden %s: ok\n", name.c_str());
+				continue;
+			}
+			size_t line = 1, i = 0;
+			while (i < expected.size() && i < actual.size()
+			       && expected[i] == actual[i]) {
+				line += expected[i++] == '\n';
+			}
+			printf("golden %s: differs from line %zu\n", name.c_str(), line);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+void remove_tree(const std::string &dir) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		execl("/bin/rm", "rm", "-rf", dir.c_str(), (char *)nullptr);
+		_exit(127);
+	}
+	if (pid > 0) {
+		waitpid(pid, nullptr, 0);
+	}
+}
+
+std::string to_json(const std::vector<Corpus> &corpora,
+                    const std::vector<Measurement> &results,
+                    const std::vector<std::pair<size_t, long>> &peaks,
+                    int jobs) {
+	char buffer[512];
+	std::string out = "{\n  \"jobs\": " + std::to_string(jobs) + ",\n";
+	out += "  \"corpora\": [\n";
+	for (size_t i = 0; i < corpora.size(); ++i) {
+		const auto &corpus = corpora[i];
+		const auto &result = results[i];
+		snprintf(buffer, sizeof(buffer),
+		         "    {\"name\": \"%s\", \"files\": %zu, \"lines\": %zu, "
+		         "\"seconds\": %.4f, \"files_per_second\": %.1f, "
+		         "\"lines_per_second\": %.0f, \"peak_rss_kb\": %ld}%s\n",
+		         corpus.name.c_str(), corpus.files.size(), corpus.lines,
+		         result.seconds, corpus.files.size() / result.seconds,
+		         corpus.lines / result.seconds, result.peak_rss_kb,
+		         i + 1 < corpora.size() ? "," : "");
+		out += buffer;
+	}
+	out += "  ],\n  \"rss\": [\n";
+	for (size_t i = 0; i < peaks.size(); ++i) {
+		snprintf(buffer, sizeof(buffer),
+		         "    {\"files\": %zu, \"peak_rss_kb\": %ld}%s\n",
+		         peaks[i].first, peaks[i].second,
+		         i + 1 < peaks.size() ? "," : "");
+		out += buffer;
+	}
+	out += "  ]\n}\n";
+	return out;
+}
+
+int main(int argc, char *argv[]) {
+	CorpusOptions options;
+	for (int i = 1; i < argc; ++i) {
+		std::string value{argv[i]};
+		if (value == "--help" || i + 1 >= argc) {
+			fprintf(stderr, "%s", Usage);
+			return 1;
+		}
+		std::string arg{argv[++i]};
+		if (value == "-pocdoc") {
+			options.pocdoc = arg;
+		} else if (value == "-j") {
+			options.jobs = std::max(1, atoi(arg.c_str()));
+		} else if (value == "-runs") {
+			options.runs = std::max(1, atoi(arg.c_str()));
+		} else if (value == "-max-lines") {
+			options.max_lines = strtoull(arg.c_str(), nullptr, 10);
+		} else if (value == "-max-growth") {
+			options.max_growth = atof(arg.c_str());
+		} else if (value == "-baseline") {
+			options.baseline = arg;
+		} else if (value == "-margin") {
+			options.margin = atoi(arg.c_str());
+		} else if (value == "-max-files") {
+			options.max_files = strtoull(arg.c_str(), nullptr, 10);
+		} else if (value == "-rss-margin") {
+			options.rss_margin = atoi(arg.c_str());
+		} else if (value == "-write-baseline") {
+			options.write_baseline = arg;
+		} else if (value == "-golden") {
+			options.golden = arg;
+		} else if (value == "-o") {
+			options.output = arg;
+		} else {
+			fprintf(stderr, "error: unknown option '%s'\n", value.c_str());
+			return 1;
+		}
+	}
+
+	// The child runs in other directories for the golden check
+	char resolved[PATH_MAX];
+	if (realpath(options.pocdoc.c_str(), resolved) == nullptr) {
+		fprintf(stderr, "error: no pocdoc binary at '%s'\n",
+		        options.pocdoc.c_str());
+		return 1;
+	}
+	options.pocdoc = resolved;
+
+	char root[] = "/tmp/pocdoc-corpus-XXXXXX";
+	if (mkdtemp(root) == nullptr) {
+		fprintf(stderr, "error: could not create a temporary directory\n");
+		return 1;
+	}
+	std::string out_dir = std::string{root} + "/out";
+	mkdir(out_dir.c_str(), 0755);
+
+	std::vector<Corpus> corpora;
+	SynthOptions synth;
+	bool ok = true;
+	for (size_t lines = 1000; lines <= options.max_lines && ok; lines *= 10) {
+		Corpus corpus;
+		corpus.name = lines >= 1000000
+		            ? std::to_string(lines / 1000000) + "M-lines"
+		            : std::to_string(lines / 1000) + "k-lines";
+		corpus.scaled = true;
+		ok = generate(corpus, root, lines, synth, FileLines);
+		corpora.push_back(std::move(corpus));
+	}
+	// A single very large header, one that is a single class with 50k
+	// members and one as deeply nested as a header will reasonably get.
+	Corpus single;
+	single.name = "single-200k";
+	single.single = true;
+	ok = ok && generate(single, root, 200000, synth, 200000);
+	corpora.push_back(std::move(single));
+	Corpus large_class;
+	large_class.name = "class-50k";
+	large_class.single = true;
+	ok = ok && generate_class(large_class, root, synth, 50000);
+	corpora.push_back(std::move(large_class));
+	Corpus nested;
+	nested.name = "nested-10";
+	auto deep = synth;
+	deep.depth = 10;
+	ok = ok && generate(nested, root, 20000, deep, 20000);
+	corpora.push_back(std::move(nested));
+	// Comments attached by libclang against the heuristic, on the
+	// scaled corpus of 100k lines or the largest one below it.
+	Corpus raw;
+	raw.name = "raw-comments";
+	raw.args = {"-raw-comments"};
+	for (const auto &corpus : corpora) {
+		if (corpus.scaled && raw.lines < 100000) {
+			raw.files = corpus.files;
+			raw.lines = corpus.lines;
+			raw.variant_of = corpus.name;
+		}
+	}
+	corpora.push_back(std::move(raw));
+	if (!ok) {
+		fprintf(stderr, "error: could not write corpus in '%s'\n", root);
+		remove_tree(root);
+		return 1;
+	}
+
+	printf("%-14s %6s %9s %10s %10s %12s %10s\n", "corpus", "files",
+	       "lines", "seconds", "files/s", "lines/s", "peak kB");
+	std::vector<Measurement> results(corpora.size());
+	for (size_t i = 0; i < corpora.size() && ok; ++i) {
+		const auto &corpus = corpora[i];
+		ok = measure(options, out_dir, corpus, results[i]);
+		const auto &result = results[i];
+		printf("%-14s %6zu %9zu %10.3f %10.1f %12.0f %10ld\n",
+		       corpus.name.c_str(), corpus.files.size(), corpus.lines,
+		       result.seconds, corpus.files.size() / result.seconds,
+		       corpus.lines / result.seconds, result.peak_rss_kb);
+		fflush(stdout);
+	}
+	if (!ok) {
+		remove_tree(root);
+		return 1;
+	}
+	for (size_t i = 0; i < corpora.size(); ++i) {
+		for (size_t j = 0; j < corpora.size(); ++j) {
+			if (corpora[i].variant_of == corpora[j].name) {
+				printf("%s: %.2fx the time of %s\n", corpora[i].name.c_str(),
+				       results[i].seconds / results[j].seconds,
+				       corpora[j].name.c_str());
+			}
+		}
+	}
+
+	// Time per line may only shrink or stay put as the corpus grows,
+	// the startup cost of small corpora makes them slower per line.
+	// Single large headers are held to the largest corpus they aren't
+	// bigger than, members of one large class must not cost more per
+	// line than declarations spread over many.
+	const Corpus *previous = nullptr;
+	const Measurement *previous_result = nullptr;
+	for (size_t i = 0; i < corpora.size(); ++i) {
+		const auto &corpus = corpora[i];
+		const Corpus *compare = nullptr;
+		const Measurement *compare_result = nullptr;
+		if (corpus.scaled) {
+			compare = previous;
+			compare_result = previous_result;
+			previous = &corpus;
+			previous_result = &results[i];
+		} else if (corpus.single) {
+			for (size_t j = 0; j < i; ++j) {
+				if (corpora[j].scaled && corpora[j].lines <= corpus.lines) {
+					compare = &corpora[j];
+					compare_result = &results[j];
+				}
+			}
+		}
+		if (compare == nullptr) {
+			continue;
+		}
+		double growth = (results[i].seconds / corpus.lines)
+		              / (compare_result->seconds / compare->lines);
+		if (growth > options.max_growth) {
+			printf("error: time per line grew %.2fx from %s to %s\n",
+			       growth, compare->name.c_str(), corpus.name.c_str());
+			ok = false;
+		}
+	}
+
+	// Only an explicitly empty baseline such as /dev/null skips the
+	// comparison, a missing one would otherwise pass silently.
+	std::map<std::string, double> baseline;
+	if (!load_baseline(options.baseline, baseline)) {
+		printf("error: could not read baseline '%s'\n",
+		       options.baseline.c_str());
+		ok = false;
+	} else if (baseline.empty()) {
+		printf("empty baseline '%s', skipping comparison\n",
+		       options.baseline.c_str());
+	}
+	for (size_t i = 0; i < corpora.size() && !baseline.empty(); ++i) {
+		auto it = baseline.find(corpora[i].name);
+		if (it == baseline.end()) {
+			printf("no baseline for %s\n", corpora[i].name.c_str());
+			continue;
+		}
+		double lines_per_second = corpora[i].lines / results[i].seconds;
+		double floor = it->second * (100 - options.margin) / 100;
+		if (lines_per_second < floor) {
+			printf("error: %s ran at %.0f lines/s, baseline is %.0f\n",
+			       corpora[i].name.c_str(), lines_per_second, it->second);
+			ok = false;
+		}
+	}
+
+	std::vector<std::pair<size_t, long>> peaks;
+	ok = check_rss(options, root, out_dir, peaks) && ok;
+	ok = check_golden(options, out_dir) && ok;
+
+	if (options.write_baseline != "") {
+		std::ofstream file{options.write_baseline};
+		file << "# Lines per second of pocdoc -j " << options.jobs
+		     << " on each generated corpus\n";
+		for (size_t i = 0; i < corpora.size(); ++i) {
+			file << corpora[i].name << ' '
+			     << uint64_t(corpora[i].lines / results[i].seconds) << '\n';
+		}
+		if (!file) {
+			fprintf(stderr, "error: could not write '%s'\n",
+			        options.write_baseline.c_str());
+			ok = false;
+		}
+	}
+	if (options.output != "") {
+		std::ofstream file{options.output};
+		file << to_json(corpora, results, peaks, options.jobs);
+		if (!file) {
+			fprintf(stderr, "error: could not write '%s'\n",
+			        options.output.c_str());
+			ok = false;
+		}
+	}
+
+	remove_tree(root);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,546 @@
+// Copyright (c) 2020 stillwwater
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+// Microbenchmarks of the text and declaration tree hot paths, run on a
+// generated header. Results are written as JSON so runs can be compared.
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include "../pocdoc.h"
+#include "synth.h"
+
+static const char *Usage =
+"pocdoc-bench [options]\n\n"
+"options:\n"
+"  -decls N             Declarations in the generated header (1000)\n"
+"  -depth N             Namespaces each declaration is nested in (2)\n"
+"  -comments N          Percent of documented declarations (50)\n"
+"  -line-length N       Approximate length of source lines (60)\n"
+"  -seed N              Seed of the generated header (1)\n"
+"  -class-members N     Members of the single class inserted by\n"
+"                       Header::insert_class, 0 skips it (50000)\n"
+"  -min-time ms         Time each benchmark runs for at least (200)\n"
+"  -o out.json          Write results to a file instead of stdout\n";
+
+struct Result {
+	std::string name;
+	// Things processed per iteration, lines, bytes or declarations
+	size_t items;
+	const char *unit;
+	uint64_t iterations;
+	double ns_per_iteration;
+};
+
+// Keeps results of benchmarked calls alive so they aren't optimized out
+static volatile size_t sink;
+
+// Runs f until it took min_time in total, in 5 rounds, and keeps the
+// fastest round. Each call of f is one iteration.
+template<typename F>
+Result measure(const char *name, size_t items, const char *unit,
+               double min_time_ms, F &&f) {
+	using Clock = std::chrono::steady_clock;
+	uint64_t batch = 1;
+	for (;;) {
+		auto start = Clock::now();
+		for (uint64_t i = 0; i < batch; ++i) {
+			sink = sink + f();
+		}
+		std::chrono::duration<double, std::milli> took = Clock::now() - start;
+		if (took.count() * 5 >= min_time_ms || batch >= (uint64_t{1} << 40)) {
+			break;
+		}
+		batch *= 2;
+	}
+	double best = 0;
+	for (int round = 0; round < 5; ++round) {
+		auto start = Clock::now();
+		for (uint64_t i = 0; i < batch; ++i) {
+			sink = sink + f();
+		}
+		std::chrono::duration<double, std::nano> took = Clock::now() - start;
+		double ns = took.count() / double(batch);
+		if (round == 0 || ns < best) {
+			best = ns;
+		}
+	}
+	fprintf(stderr, "%-28s %12.1f ns %10.2f ns/%s\n", name, best,
+	        best / double(items ? items : 1), unit);
+	return {name, items, unit, batch * 5, best};
+}
+
+namespace pocdoc {
+
+// The line splitting and comment lookup pocdoc used before scan_lines,
+// kept to compare the kernels against. Each line is trimmed again
+// every time it is looked at.
+namespace previous {
+
+static void split_lines(std::string_view text, std::vector<char> &contents,
+                        std::vector<std::string_view> &lines) {
+	std::vector<std::pair<size_t, size_t>> offsets;
+	contents.reserve(text.size());
+
+	while (!text.empty()) {
+		auto eol = text.find('\n');
+		auto line = text.substr(0, eol);
+		text.remove_prefix(eol == std::string_view::npos
+		                   ? text.size() : eol + 1);
+
+		auto trimmed = line;
+		ltrim(trimmed, ' ', '\t');
+		if (trimmed.size() > 0 && trimmed[0] == '#') {
+			continue;
+		}
+		offsets.emplace_back(contents.size(), line.size());
+		contents.insert(contents.end(), line.begin(), line.end());
+		contents.push_back('\n');
+	}
+
+	lines.reserve(offsets.size());
+	for (auto [offset, size] : offsets) {
+		lines.emplace_back(contents.data() + offset, size);
+	}
+}
+
+// Stops at the first line where the original wrapped around.
+static std::optional<SourceRange>
+find_doc(const std::vector<std::string_view> &lines, unsigned linenum) {
+	if (linenum == 0 || --linenum >= lines.size()) {
+		return {};
+	}
+	std::string_view line;
+	unsigned start = 0;
+	unsigned end = linenum;
+	bool found_comment = false;
+
+	for (int repeat = 0; repeat < 2; --linenum) {
+		line = lines[linenum];
+		ltrim(line, ' ', '\t');
+		if (line.rfind("//", 0) != 0) {
+			if (found_comment) {
+				start = linenum + 1;
+				break;
+			}
+			--end;
+			++repeat;
+		} else {
+			found_comment = true;
+		}
+		if (linenum == 0) {
+			break;
+		}
+	}
+
+	if (!found_comment) {
+		return {};
+	}
+	return SourceRange{start, end};
+}
+
+} // namespace previous
+
+// Has access to Header's internals to time them on their own.
+class HeaderBench {
+public:
+	HeaderBench(Header &header, double min_time_ms)
+		: header{header}, min_time_ms{min_time_ms} {}
+
+	void run(CXTranslationUnit tu, std::vector<Result> &results);
+
+	// Inserts a header that is one large class, every member looks up
+	// the same parent and is appended to its child list.
+	void large_class(std::vector<Result> &results);
+
+private:
+	std::vector<std::pair<Node, std::optional<QualifiedName>>> inserts();
+
+	void scan(std::vector<Result> &results);
+	void trim(std::vector<Result> &results);
+	void find_doc(std::vector<Result> &results);
+	void parse_source(std::vector<Result> &results);
+	void parse_comment(std::vector<Result> &results);
+	void qualified_names(CXTranslationUnit tu, std::vector<Result> &results);
+	void tree(std::vector<Result> &results);
+	void toc(std::vector<Result> &results);
+
+	Header &header;
+	double min_time_ms;
+};
+
+void HeaderBench::run(CXTranslationUnit tu, std::vector<Result> &results) {
+	scan(results);
+	trim(results);
+	find_doc(results);
+	parse_source(results);
+	parse_comment(results);
+	qualified_names(tu, results);
+	tree(results);
+	toc(results);
+}
+
+void HeaderBench::scan(std::vector<Result> &results) {
+	auto text = header.text();
+	std::vector<LineInfo> lines;
+	results.push_back(measure("scan_lines", text.size(), "byte",
+	                          min_time_ms, [&] {
+		lines.clear();
+		scan_lines<scan_block>(text, lines);
+		return lines.size();
+	}));
+	results.push_back(measure("scan_lines_scalar", text.size(), "byte",
+	                          min_time_ms, [&] {
+		lines.clear();
+		scan_lines<scan_block_scalar>(text, lines);
+		return lines.size();
+	}));
+	results.push_back(measure("split_lines_previous", text.size(), "byte",
+	                          min_time_ms, [&] {
+		std::vector<char> contents;
+		std::vector<std::string_view> lines;
+		previous::split_lines(text, contents, lines);
+		return lines.size();
+	}));
+}
+
+void HeaderBench::trim(std::vector<Result> &results) {
+	const auto &lines = header.source.lines;
+	results.push_back(measure("ltrim", lines.size(), "line",
+	                          min_time_ms, [&] {
+		size_t total = 0;
+		for (auto line : lines) {
+			ltrim(line, ' ', '\t');
+			total += line.size();
+		}
+		return total;
+	}));
+	results.push_back(measure("rtrim", lines.size(), "line",
+	                          min_time_ms, [&] {
+		size_t total = 0;
+		for (auto line : lines) {
+			rtrim(line, '{', ';', ' ');
+			total += line.size();
+		}
+		return total;
+	}));
+}
+
+void HeaderBench::find_doc(std::vector<Result> &results) {
+	auto count = unsigned(header.source.lines.size());
+	results.push_back(measure("Header::find_doc", count, "line",
+	                          min_time_ms, [&] {
+		size_t found = 0;
+		for (unsigned line = 1; line <= count; ++line) {
+			found += header.find_doc(line).has_value();
+		}
+		return found;
+	}));
+	std::vector<char> contents;
+	std::vector<std::string_view> lines;
+	previous::split_lines(header.text(), contents, lines);
+	results.push_back(measure("find_doc_previous", count, "line",
+	                          min_time_ms, [&] {
+		size_t found = 0;
+		for (unsigned line = 1; line <= count; ++line) {
+			found += previous::find_doc(lines, line).has_value();
+		}
+		return found;
+	}));
+}
+
+void HeaderBench::parse_source(std::vector<Result> &results) {
+	size_t count = header.nodes.size() - 1;
+	results.push_back(measure("Header::parse_source", count, "decl",
+	                          min_time_ms, [&] {
+		size_t total = 0;
+		for (size_t i = 1; i < header.nodes.size(); ++i) {
+			const auto &range = header.nodes[i].decl_range;
+			total += header.parse_source(range.line_start,
+			                             range.line_end, 0).size();
+		}
+		return total;
+	}));
+}
+
+void HeaderBench::parse_comment(std::vector<Result> &results) {
+	std::vector<SourceRange> ranges;
+	for (const auto &node : header.nodes) {
+		if (node.doc_range) {
+			ranges.push_back(*node.doc_range);
+		}
+	}
+	results.push_back(measure("Header::parse_comment", ranges.size(),
+	                          "comment", min_time_ms, [&] {
+		size_t total = 0;
+		for (const auto &range : ranges) {
+			total += header.parse_comment(range).size();
+		}
+		return total;
+	}));
+}
+
+void HeaderBench::qualified_names(CXTranslationUnit tu,
+                                  std::vector<Result> &results) {
+	std::vector<CXCursor> cursors;
+	clang_visitChildren(clang_getTranslationUnitCursor(tu),
+		[](CXCursor cursor, CXCursor, CXClientData data) {
+			if (clang_isDeclaration(clang_getCursorKind(cursor))) {
+				static_cast<std::vector<CXCursor> *>(data)->push_back(cursor);
+			}
+			return CXChildVisit_Recurse;
+		}, &cursors);
+
+	results.push_back(measure("get_qualified_name", cursors.size(), "cursor",
+	                          min_time_ms, [&] {
+		size_t total = 0;
+		for (const auto &cursor : cursors) {
+			total += get_qualified_name(cursor).size();
+		}
+		return total;
+	}));
+	// A new cache per iteration, as each translation unit starts with
+	// an empty one.
+	results.push_back(measure("QualifiedNameCache::get", cursors.size(),
+	                          "cursor", min_time_ms, [&] {
+		QualifiedNameCache cache;
+		size_t total = 0;
+		for (const auto &cursor : cursors) {
+			total += cache.get(cursor).str().size();
+		}
+		return total;
+	}));
+}
+
+// Every parsed declaration with the container it is inserted under
+std::vector<std::pair<Node, std::optional<QualifiedName>>>
+HeaderBench::inserts() {
+	std::vector<std::pair<Node, std::optional<QualifiedName>>> inserts;
+	for (size_t i = 1; i < header.nodes.size(); ++i) {
+		const auto &node = header.nodes[i];
+		std::optional<QualifiedName> container;
+		if (node.parent != RootNode) {
+			container = header.nodes[node.parent].qualified_name;
+		}
+		inserts.emplace_back(node, container);
+	}
+	return inserts;
+}
+
+void HeaderBench::large_class(std::vector<Result> &results) {
+	auto inserts = this->inserts();
+	results.push_back(measure("Header::insert_class", inserts.size(), "decl",
+	                          min_time_ms, [&] {
+		Header tree{header.filename, Source{}, header.options};
+		for (const auto &[node, container] : inserts) {
+			tree.insert(Node{node}, container);
+		}
+		return tree.nodes.size();
+	}));
+}
+
+void HeaderBench::tree(std::vector<Result> &results) {
+	auto inserts = this->inserts();
+
+	results.push_back(measure("Header::insert", inserts.size(), "decl",
+	                          min_time_ms, [&] {
+		Header tree{header.filename, Source{}, header.options};
+		for (const auto &[node, container] : inserts) {
+			tree.insert(Node{node}, container);
+		}
+		return tree.nodes.size();
+	}));
+
+	Header tree{header.filename, Source{}, header.options};
+	for (const auto &[node, container] : inserts) {
+		tree.insert(Node{node}, container);
+	}
+	results.push_back(measure("Header::find", inserts.size(), "decl",
+	                          min_time_ms, [&] {
+		size_t found = 0;
+		for (const auto &insert : inserts) {
+			found += tree.find(insert.first.qualified_name) != nullptr;
+		}
+		return found;
+	}));
+}
+
+void HeaderBench::toc(std::vector<Result> &results) {
+	results.push_back(measure("build_toc", header.nodes.size() - 1, "decl",
+	                          min_time_ms, [&] {
+		// A new renderer each time, like each header of a run, so the
+		// table of contents doesn't keep growing across iterations.
+		auto renderer = make_renderer(FormatMarkdown, header.options);
+		std::vector<Renderer *> renderers{renderer.get()};
+		renderer->begin(header.filename);
+		header.render_toc(renderers, header.nodes[pocdoc::RootNode], 0);
+		return renderer->finish().toc.size();
+	}));
+}
+
+} // namespace pocdoc
+
+void append_json_string(std::string &out, const std::string &str) {
+	out += '"';
+	for (char c : str) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+		}
+		out += c;
+	}
+	out += '"';
+}
+
+std::string to_json(const SynthOptions &synth, const pocdoc::Header &header,
+                    size_t class_members,
+                    const std::vector<Result> &results) {
+	auto text = header.text();
+	auto lines = size_t(std::count(text.begin(), text.end(), '\n'));
+	char buffer[512];
+	std::string out = "{\n  \"input\": {";
+	snprintf(buffer, sizeof(buffer),
+	         "\"decls\": %zu, \"depth\": %d, \"comment_density\": %d, "
+	         "\"line_length\": %zu, \"seed\": %llu, \"lines\": %zu, "
+	         "\"bytes\": %zu, \"class_members\": %zu},\n",
+	         synth.decls, synth.depth, synth.comment_density,
+	         synth.line_length, (unsigned long long)synth.seed, lines,
+	         text.size(), class_members);
+	out += buffer;
+	out += "  \"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const auto &result = results[i];
+		out += "    {\"name\": ";
+		append_json_string(out, result.name);
+		snprintf(buffer, sizeof(buffer),
+		         ", \"items\": %zu, \"unit\": \"%s\", \"iterations\": %llu, "
+		         "\"ns_per_iteration\": %.1f, \"ns_per_item\": %.3f}%s\n",
+		         result.items, result.unit,
+		         (unsigned long long)result.iterations,
+		         result.ns_per_iteration,
+		         result.ns_per_iteration
+		             / double(result.items ? result.items : 1),
+		         i + 1 < results.size() ? "," : "");
+		out += buffer;
+	}
+	out += "  ]\n}\n";
+	return out;
+}
+
+// Writes a generated header and parses it like any other input
+std::unique_ptr<pocdoc::Header> parse_synth(CXIndex index,
+                                            const SynthOptions &synth,
+                                            pocdoc::TranslationUnit &tu) {
+	// The header goes through read_source like any other input
+	char path[] = "/tmp/pocdoc-bench-XXXXXX.h";
+	int fd = mkstemps(path, 2);
+	if (fd < 0 || (close(fd), !write_synth_header(path, synth))) {
+		fprintf(stderr, "error: could not write generated header\n");
+		return nullptr;
+	}
+	pocdoc::Options options;
+	options.build_toc = true;
+	auto header = std::make_unique<pocdoc::Header>(
+		path, pocdoc::read_source(path), options);
+	tu = pocdoc::parse_translation_unit(index, path, header->text(),
+	                                    options);
+	unlink(path);
+	if (tu == nullptr) {
+		fprintf(stderr, "error: could not parse generated header\n");
+		return nullptr;
+	}
+	header->parse(tu.get());
+	return header;
+}
+
+int main(int argc, char *argv[]) {
+	SynthOptions synth;
+	size_t class_members = 50000;
+	double min_time_ms = 200;
+	std::string output;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string value{argv[i]};
+		if (value == "--help" || i + 1 >= argc) {
+			fprintf(stderr, "%s", Usage);
+			return 1;
+		}
+		auto number = strtoull(argv[++i], nullptr, 10);
+		if (value == "-decls") {
+			synth.decls = number;
+		} else if (value == "-depth") {
+			synth.depth = int(number);
+		} else if (value == "-comments") {
+			synth.comment_density = int(number);
+		} else if (value == "-line-length") {
+			synth.line_length = number;
+		} else if (value == "-seed") {
+			synth.seed = number;
+		} else if (value == "-class-members") {
+			class_members = number;
+		} else if (value == "-min-time") {
+			min_time_ms = double(number);
+		} else if (value == "-o") {
+			output = argv[i];
+		} else {
+			fprintf(stderr, "error: unknown option '%s'\n", value.c_str());
+			return 1;
+		}
+	}
+
+	pocdoc::Index index;
+	pocdoc::TranslationUnit tu;
+	auto header = parse_synth(index, synth, tu);
+	if (header == nullptr) {
+		return 1;
+	}
+	std::vector<Result> results;
+	pocdoc::HeaderBench{*header, min_time_ms}.run(tu.get(), results);
+
+	// One class with all the members, children used to be found by
+	// walking the whole tree for each of them.
+	if (class_members > 0) {
+		auto large = synth;
+		large.members = class_members;
+		large.decls = class_members + 1;
+		pocdoc::TranslationUnit class_tu;
+		auto class_header = parse_synth(index, large, class_tu);
+		if (class_header == nullptr) {
+			return 1;
+		}
+		class_tu.reset();
+		pocdoc::HeaderBench{*class_header, min_time_ms}.large_class(results);
+	}
+
+	auto json = to_json(synth, *header, class_members, results);
+	if (output == "") {
+		fputs(json.c_str(), stdout);
+		return 0;
+	}
+	FILE *file = fopen(output.c_str(), "wb");
+	if (file == nullptr || fputs(json.c_str(), file) < 0) {
+		fprintf(stderr, "error: could not write '%s'\n", output.c_str());
+		return 1;
+	}
+	fclose(file);
+	return 0;
+}
@@ -0,0 +1,238 @@
+// Copyright (c) 2020 stillwwater
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#ifndef POCDOC_BENCH_SYNTH_H
+#define POCDOC_BENCH_SYNTH_H
+
+#include <string>
+#include <cstdint>
+#include <cstdio>
+
+// Shape of a generated header. The same options and seed always give
+// the same header, so benchmark inputs don't have to be checked in.
+struct SynthOptions {
+	// Declarations to generate, counting members of structs
+	size_t decls = 1000;
+	// Namespaces each declaration is nested in
+	int depth = 2;
+	// Percent of declarations with a documentation comment
+	int comment_density = 50;
+	// Approximate length of declaration and comment lines, declarations
+	// get more parameters and comments more words to reach it.
+	size_t line_length = 60;
+	// Members of each struct, 2 to 9 at random when 0. When set every
+	// declaration is a struct, so with decls one more than members the
+	// header is a single large class.
+	size_t members = 0;
+	uint64_t seed = 1;
+};
+
+// Small deterministic generator, std distributions differ between
+// standard libraries.
+class SynthRandom {
+public:
+	explicit SynthRandom(uint64_t seed) : state{seed * 2 + 1} {}
+
+	uint32_t next() {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return uint32_t(state >> 32);
+	}
+
+	// True with a chance of percent in 100
+	bool chance(int percent) { return int(next() % 100) < percent; }
+
+	uint32_t below(uint32_t n) { return next() % n; }
+
+private:
+	uint64_t state;
+};
+
+class Synth {
+public:
+	explicit Synth(const SynthOptions &options)
+		: options{options}, random{options.seed} {}
+
+	std::string generate();
+
+private:
+	void open_namespaces();
+	void close_namespaces();
+	void comment(const char *indent);
+	void parameters(size_t line_start);
+	void function(const char *indent, bool member);
+	void structure();
+	void enumeration();
+	void variable();
+	void alias();
+
+	const SynthOptions &options;
+	SynthRandom random;
+	std::string out;
+	size_t emitted = 0;
+	size_t id = 0;
+};
+
+inline const char *const SynthWords[] = {
+	"returns", "the", "number", "of", "elements", "in", "a", "buffer",
+	"`size`", "must", "be", "*positive*", "and", "less", "than", "capacity",
+};
+
+inline void Synth::comment(const char *indent) {
+	if (!random.chance(options.comment_density)) {
+		return;
+	}
+	int lines = 1 + int(random.below(3));
+	for (int i = 0; i < lines; ++i) {
+		auto line_start = out.size();
+		out += indent;
+		out += "// ";
+		do {
+			out += SynthWords[random.below(16)];
+			out += ' ';
+		} while (out.size() - line_start < options.line_length);
+		out.back() = '\n';
+	}
+}
+
+inline void Synth::parameters(size_t line_start) {
+	out += '(';
+	int count = 0;
+	do {
+		if (count > 0) {
+			out += ", ";
+		}
+		out += count % 3 == 2 ? "const char *" : "int ";
+		out += "arg" + std::to_string(count++);
+	} while (out.size() - line_start < options.line_length);
+	out += ')';
+}
+
+inline void Synth::function(const char *indent, bool member) {
+	comment(indent);
+	auto line_start = out.size();
+	out += indent;
+	out += member && random.chance(30) ? "virtual int " : "int ";
+	out += "function" + std::to_string(id++);
+	parameters(line_start);
+	out += member && random.chance(50) ? " const;\n" : ";\n";
+	++emitted;
+}
+
+inline void Synth::structure() {
+	comment("");
+	out += "struct Type" + std::to_string(id++) + " {\n";
+	++emitted;
+	size_t members = options.members ? options.members
+	                                 : 2 + random.below(8);
+	for (size_t i = 0; i < members && emitted < options.decls; ++i) {
+		if (i % 2 == 0) {
+			comment("\t");
+			out += "\tint field" + std::to_string(id++) + ";\n";
+			++emitted;
+		} else {
+			function("\t", true);
+		}
+	}
+	out += "};\n";
+}
+
+inline void Synth::enumeration() {
+	comment("");
+	out += "enum class Kind" + std::to_string(id++) + " {\n";
+	++emitted;
+	int values = 2 + int(random.below(6));
+	for (int i = 0; i < values; ++i) {
+		out += "\tValue" + std::to_string(i) + ",\n";
+	}
+	out += "};\n";
+}
+
+inline void Synth::variable() {
+	comment("");
+	out += "extern const int constant" + std::to_string(id++) + ";\n";
+	++emitted;
+}
+
+inline void Synth::alias() {
+	comment("");
+	out += "using Alias" + std::to_string(id++) + " = int;\n";
+	++emitted;
+}
+
+inline void Synth::open_namespaces() {
+	for (int i = 0; i < options.depth; ++i) {
+		out += "namespace n" + std::to_string(id++) + " {\n";
+	}
+}
+
+inline void Synth::close_namespaces() {
+	for (int i = 0; i < options.depth; ++i) {
+		out += "}\n";
+	}
+}
+
+inline std::string Synth::generate() {
+	out = "#pragma once\n\n";
+	while (emitted < options.decls) {
+		// Namespaces are reopened every so often so large headers have
+		// many of them.
+		open_namespaces();
+		for (int i = 0; i < 64 && emitted < options.decls; ++i) {
+			switch (options.members ? 0 : random.below(8)) {
+			case 0: case 1: case 2:
+				structure();
+				break;
+			case 3: case 4:
+				function("", false);
+				break;
+			case 5:
+				enumeration();
+				break;
+			case 6:
+				variable();
+				break;
+			default:
+				alias();
+				break;
+			}
+			out += '\n';
+		}
+		close_namespaces();
+		out += '\n';
+	}
+	return std::move(out);
+}
+
+inline std::string synth_header(const SynthOptions &options) {
+	return Synth{options}.generate();
+}
+
+inline bool write_synth_header(const std::string &path,
+                        const SynthOptions &options) {
+	auto text = synth_header(options);
+	FILE *file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		return false;
+	}
+	bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+	return fclose(file) == 0 && ok;
+}
+
+#endif // POCDOC_BENCH_SYNTH_H
@@ -0,0 +1,3795 @@
+// Copyright (c) 2020 stillwwater
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include "pocdoc.h"
+
+namespace pocdoc {
+
+class MarkdownRenderer : public Renderer {
+public:
+	explicit MarkdownRenderer(const Options &options)
+		: build_toc{options.build_toc} {}
+
+	void begin(const std::string &filename) override;
+	void toc_entry(const Node &node, const char *kind, int depth) override;
+	void begin_decl(const RenderDecl &decl,
+	                const std::vector<RenderField> &fields) override;
+	void end_decl(const RenderDecl &decl) override;
+	const Output &finish() override;
+
+private:
+	bool build_toc;
+};
+
+// Appends text with the characters HTML gives a meaning escaped.
+void append_html(Buffer &buffer, std::string_view text);
+
+// A standalone page per header. Anchors use the same ids as the
+// markdown output so links between the two formats line up.
+class HtmlRenderer : public Renderer {
+public:
+	void begin(const std::string &filename) override;
+	void toc_entry(const Node &node, const char *kind, int depth) override;
+	void begin_decl(const RenderDecl &decl,
+	                const std::vector<RenderField> &fields) override;
+	void end_decl(const RenderDecl &decl) override;
+	const Output &finish() override;
+
+private:
+	void append_anchor(const char *kind, const Node &node);
+
+	int toc_lists = 0; // Nested <ul> currently open in the toc
+};
+
+// Appends text as a quoted JSON string.
+void append_json(Buffer &buffer, std::string_view text);
+
+// One object per header with the documented declarations nested under
+// their containers. The table of contents is left out, it can be
+// derived from the declarations.
+class JsonRenderer : public Renderer {
+public:
+	void begin(const std::string &filename) override;
+	void toc_entry(const Node &, const char *, int) override {}
+	void begin_decl(const RenderDecl &decl,
+	                const std::vector<RenderField> &fields) override;
+	void end_decl(const RenderDecl &decl) override;
+	void begin_section() override;
+	bool uses_lines() const override { return true; }
+	const Output &finish() override;
+
+private:
+	void separate();
+
+	// For each open array of declarations, whether it is still empty
+	std::vector<bool> empty;
+};
+
+struct Token {
+	enum Kind : uint8_t {
+		Identifier,
+		Literal,
+		Punct,
+		End,
+	};
+	Kind kind;
+	unsigned line;
+	std::string_view text;
+	// Index of the matching bracket for '(', '[', '{' and their closers
+	uint32_t match = 0;
+};
+
+bool isopen(const Token &tok);
+
+bool isclose(const Token &tok);
+
+enum CharClass : uint8_t {
+	CharSpace = 1 << 0,
+	CharDigit = 1 << 1,
+	CharIdent = 1 << 2,
+};
+
+constexpr std::array<uint8_t, 256> make_char_table() {
+	std::array<uint8_t, 256> table{};
+	for (unsigned char c : {' ', '\t', '\r', '\f', '\v'}) {
+		table[c] = CharSpace;
+	}
+	for (int c = 0; c < 256; ++c) {
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+		    || c == '_' || c == '$') {
+			table[c] = CharIdent;
+		}
+		if (c >= '0' && c <= '9') {
+			table[c] = CharDigit | CharIdent;
+		}
+	}
+	return table;
+}
+
+constexpr std::array<uint8_t, 256> char_table = make_char_table();
+
+// Splits source into tokens, dropping comments. Fails on unbalanced
+// brackets and on literals the scanner doesn't handle (raw strings).
+bool tokenize(std::string_view text, std::vector<Token> &tokens);
+
+// Builds a header's declaration tree from tokens, recognizing the subset
+// of C++ declarations pocdoc documents without any semantic analysis.
+// Anything outside of that subset (anonymous types, friends, explicit
+// specializations, attributes, ...) makes parse() fail so the header can
+// be handed to libclang instead.
+class FastParser {
+public:
+	explicit FastParser(Header &header) : header{header} {}
+
+	bool parse();
+
+	// Line the parser stopped at
+	unsigned line() const;
+
+	size_t token_count() const;
+
+private:
+	struct Scope {
+		CXCursorKind kind;
+		QualifiedName name;
+		std::string_view spelling;
+		CX_CXXAccessSpecifier access;
+	};
+
+	bool parse_scope(Scope &scope);
+	bool parse_statement(Scope &scope);
+	bool parse_namespace(const Scope &scope);
+	bool parse_using(const Scope &scope, unsigned line_start, bool templated);
+	bool parse_typedef(const Scope &scope, unsigned line_start);
+	bool parse_record(const Scope &scope, unsigned line_start, bool templated);
+	bool parse_enum(const Scope &scope, unsigned line_start);
+	bool parse_member(const Scope &scope, unsigned line_start, bool templated);
+	bool parse_function(unsigned &line_end, bool ctor);
+	bool parse_fields(unsigned line_start,
+	                  std::optional<QualifiedName> container,
+	                  QualifiedName parent, CX_CXXAccessSpecifier access,
+	                  size_t name_pos, CXCursorKind kind);
+	bool end_record();
+
+	bool skip_angles();
+	bool skip_until(std::initializer_list<std::string_view> stops);
+	bool skip_initializer();
+
+	std::optional<QualifiedName> resolve(const Scope &scope,
+	                                     size_t begin, size_t end);
+	QualifiedName qualify(QualifiedName parent, std::string_view name);
+
+	void add(std::optional<QualifiedName> container, QualifiedName qname,
+	         std::string_view spelling, CXCursorKind kind,
+	         CX_CXXAccessSpecifier access, SourceRange range);
+
+	const Token &peek(size_t n = 0) const;
+
+	static std::optional<QualifiedName> container_of(const Scope &scope);
+
+	static bool isreserved(std::string_view word);
+	static bool isspecifier(std::string_view word);
+	static bool isbuiltin(std::string_view word);
+
+	Header &header;
+	std::vector<Token> tokens;
+	size_t pos = 0;
+	std::string scratch;
+};
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+	explicit MappedFile(const std::string &path);
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	std::string_view view() const { return {data, size}; }
+
+private:
+	const char *data = nullptr;
+	size_t size = 0;
+};
+
+const char *decl_str(const CXCursorKind &kind) {
+	switch (kind) {
+	case CXCursor_StructDecl:  return "Struct";
+	case CXCursor_UnionDecl:   return "Union";
+	case CXCursor_EnumDecl:    return "Enum";
+
+	case CXCursor_EnumConstantDecl:
+		return "Enum Constant";
+
+	case CXCursor_ClassDecl:
+	case CXCursor_ClassTemplate:
+		return "Class";
+
+	case CXCursor_CXXMethod:
+	case CXCursor_FunctionDecl:
+	case CXCursor_FunctionTemplate:
+		return "Function";
+
+	case CXCursor_Constructor:      return "Constructor";
+	case CXCursor_Destructor:       return "Destructor";
+	case CXCursor_UsingDeclaration: return "Using";
+	case CXCursor_TypedefDecl:      return "Typedef";
+
+	case CXCursor_TypeAliasDecl:
+	case CXCursor_TypeAliasTemplateDecl:
+		return "Type Alias";
+
+	case CXCursor_VarDecl:    return "Variable";
+	case CXCursor_FieldDecl:  return "Field";
+
+	default:
+		// Kind should not be printed
+		return nullptr;
+	}
+}
+
+std::string take_string(CXString str) {
+	std::string result = clang_getCString(str);
+	clang_disposeString(str);
+	return result;
+}
+
+std::string absolute_path(const std::string &directory,
+                          const std::string &path) {
+	auto joined = path.empty() || path[0] == '/' || directory.empty()
+	            ? path : directory + "/" + path;
+	char *resolved = realpath(joined.c_str(), nullptr);
+	if (resolved == nullptr) {
+		return joined;
+	}
+	std::string result = resolved;
+	free(resolved);
+	return result;
+}
+
+std::string parent_path(const std::string &path) {
+	auto sep = path.rfind('/');
+	return sep == std::string::npos ? "" : path.substr(0, sep);
+}
+
+std::string get_qualified_name(const CXCursor &cursor) {
+	auto kind = clang_getCursorKind(cursor);
+	if (kind == CXCursor_TranslationUnit || kind == CXCursor_FirstInvalid) {
+		return "";
+	}
+	auto spelling = clang_getCursorSpelling(cursor);
+	std::string name(clang_getCString(spelling));
+	clang_disposeString(spelling);
+
+	auto res = get_qualified_name(clang_getCursorSemanticParent(cursor));
+	if (res == "") {
+		return name;
+	}
+	return res + "::" + name;
+}
+
+Name StringTable::intern(std::string_view str) {
+	if (str.empty()) {
+		return Name{};
+	}
+	auto hash = std::hash<std::string_view>{}(str);
+	auto &shard = shards[(hash >> 8) % ShardCount];
+
+	std::lock_guard<std::mutex> lock{shard.mutex};
+	auto it = shard.strings.find(str);
+	if (it != shard.strings.end()) {
+		return Name{it->second};
+	}
+	const auto &stored = shard.storage.emplace_back(str);
+	shard.strings.emplace(stored, &stored);
+	return Name{&stored};
+}
+
+Name intern(std::string_view str) {
+	return StringTable::current().intern(str);
+}
+
+QualifiedName QualifiedNameCache::get(const CXCursor &cursor) {
+	auto kind = clang_getCursorKind(cursor);
+	if (kind == CXCursor_TranslationUnit || kind == CXCursor_FirstInvalid) {
+		return QualifiedName{};
+	}
+	auto it = names.find(cursor);
+	if (it != names.end()) {
+		return it->second;
+	}
+
+	auto parent = get(clang_getCursorSemanticParent(cursor));
+	auto spelling = clang_getCursorSpelling(cursor);
+
+	scratch = parent.str();
+	if (!scratch.empty()) {
+		scratch += "::";
+	}
+	scratch += clang_getCString(spelling);
+	clang_disposeString(spelling);
+
+	auto qname = intern(scratch);
+	names.emplace(cursor, qname);
+	return qname;
+}
+
+void Buffer::reserve(size_t size) {
+	if (size <= capacity) {
+		return;
+	}
+	auto new_capacity = std::max(size, std::max(capacity * 2, size_t(4096)));
+	auto new_bytes = std::make_unique<char[]>(new_capacity);
+	if (length > 0) {
+		memcpy(new_bytes.get(), bytes.get(), length);
+	}
+	bytes = std::move(new_bytes);
+	capacity = new_capacity;
+}
+
+void Buffer::append(std::string_view str) {
+	reserve(length + str.size());
+	if (!str.empty()) {
+		memcpy(bytes.get() + length, str.data(), str.size());
+	}
+	last = length;
+	length += str.size();
+}
+
+const char *phase_str(Phase phase) {
+	static constexpr const char *names[] = {
+		"read", "parse", "visit", "render", "write",
+	};
+	return names[phase];
+}
+
+uint64_t clock_ns(clockid_t clock) {
+	timespec ts;
+	clock_gettime(clock, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void Profiler::enable(bool trace, int workers) {
+	active = true;
+	tracing = trace;
+	cpu_clock = workers == 1 ? CLOCK_PROCESS_CPUTIME_ID
+	                         : CLOCK_THREAD_CPUTIME_ID;
+	epoch = clock_ns(CLOCK_MONOTONIC);
+}
+
+void Profiler::enable_memory(size_t worst) {
+	counting = true;
+	worst_files = worst;
+}
+
+void Profiler::count_allocation(size_t size) {
+	if (!counting) {
+		return;
+	}
+	if (current_phase == PhaseCount) {
+		unattributed_count.fetch_add(1, std::memory_order_relaxed);
+		unattributed_bytes.fetch_add(size, std::memory_order_relaxed);
+		return;
+	}
+	++allocations.count[current_phase];
+	allocations.bytes[current_phase] += size;
+}
+
+// Writing 5 to clear_refs resets the peak RSS the kernel reports as
+// VmHWM to the current RSS.
+void Profiler::reset_peak_rss() {
+	int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		(void)!write(fd, "5", 1);
+		close(fd);
+	}
+}
+
+void Profiler::record_peak_rss() {
+	std::ifstream status{"/proc/self/status"};
+	std::string line;
+	size_t peak = 0;
+	while (std::getline(status, line)) {
+		if (line.rfind("VmHWM:", 0) == 0) {
+			peak = strtoull(line.c_str() + strlen("VmHWM:"), nullptr, 10);
+			break;
+		}
+	}
+	std::lock_guard<std::mutex> lock{mutex};
+	if (current_file != NoFile) {
+		auto &stats = files[current_file];
+		stats.peak_rss = std::max(stats.peak_rss, peak);
+	}
+}
+
+uint32_t Profiler::thread_id() {
+	if (current_thread == NoFile) {
+		current_thread = threads++;
+	}
+	return current_thread;
+}
+
+uint32_t Profiler::begin_file(const std::string &name) {
+	// Umbrella builds come back to a file after parsing it with others
+	std::lock_guard<std::mutex> lock{mutex};
+	auto [it, inserted] = file_index.emplace(name, uint32_t(files.size()));
+	if (inserted) {
+		files.push_back({name});
+	}
+	return it->second;
+}
+
+void Profiler::record(Phase phase, uint64_t start, uint64_t wall,
+                      uint64_t cpu, uint64_t allocations,
+                      uint64_t allocated) {
+	std::lock_guard<std::mutex> lock{mutex};
+	if (current_file == NoFile) {
+		// Work that isn't for any one file, like building preambles
+		current_file = uint32_t(files.size());
+		files.push_back({"(shared)"});
+	}
+	auto &stats = files[current_file];
+	stats.wall[phase] += wall;
+	stats.cpu[phase] += cpu;
+	stats.allocations[phase] += allocations;
+	stats.allocated[phase] += allocated;
+	if (tracing) {
+		events.push_back({phase, thread_id(), current_file,
+		                  start - epoch, wall});
+	}
+}
+
+void Profiler::count(size_t nodes, size_t cursors) {
+	std::lock_guard<std::mutex> lock{mutex};
+	if (current_file != NoFile) {
+		files[current_file].nodes += nodes;
+		files[current_file].cursors += cursors;
+	}
+}
+
+ProfileFile::ProfileFile(const std::string &name)
+	: previous{Profiler::current_file} {
+	auto &profiler = Profiler::global();
+	if (profiler.enabled()) {
+		Profiler::current_file = profiler.begin_file(name);
+	}
+	if (depth++ == 0 && Profiler::counting) {
+		profiler.reset_peak_rss();
+	}
+}
+
+ProfileFile::~ProfileFile() {
+	--depth;
+	if (Profiler::counting) {
+		Profiler::global().record_peak_rss();
+	}
+	Profiler::current_file = previous;
+}
+
+void ProfileFile::count(size_t nodes, size_t cursors) {
+	auto &profiler = Profiler::global();
+	if (profiler.enabled()) {
+		profiler.count(nodes, cursors);
+	}
+}
+
+PhaseTimer::PhaseTimer(Phase phase)
+	: phase{phase}
+	, previous{Profiler::current_phase} {
+	if (Profiler::global().enabled()) {
+		Profiler::current_phase = phase;
+		allocations = Profiler::allocations.count[phase];
+		allocated = Profiler::allocations.bytes[phase];
+		wall = clock_ns(CLOCK_MONOTONIC);
+		cpu = clock_ns(Profiler::global().cpu_clock);
+	}
+}
+
+PhaseTimer::~PhaseTimer() {
+	auto &profiler = Profiler::global();
+	if (profiler.enabled()) {
+		auto end = clock_ns(CLOCK_MONOTONIC);
+		auto end_cpu = clock_ns(profiler.cpu_clock);
+		// Counts are read before recording, which allocates itself
+		auto count = Profiler::allocations.count[phase] - allocations;
+		auto bytes = Profiler::allocations.bytes[phase] - allocated;
+		Profiler::current_phase = previous;
+		profiler.record(phase, wall, end - wall, end_cpu - cpu,
+		                count, bytes);
+	}
+}
+
+const char *format_extension(Format format) {
+	switch (format) {
+	case FormatHtml: return ".html";
+	case FormatJson: return ".json";
+	default:         return ".md";
+	}
+}
+
+BlockMasks scan_block_scalar(const char *p) {
+	BlockMasks masks{0, 0};
+	for (int i = 0; i < 64; ++i) {
+		masks.newline |= uint64_t(p[i] == '\n') << i;
+		masks.blank |= uint64_t(p[i] == ' ' || p[i] == '\t') << i;
+	}
+	return masks;
+}
+
+#if defined(__AVX2__)
+BlockMasks scan_block(const char *p) {
+	auto newline = _mm256_set1_epi8('\n');
+	auto space = _mm256_set1_epi8(' ');
+	auto tab = _mm256_set1_epi8('\t');
+	BlockMasks masks{0, 0};
+	for (int i = 0; i < 64; i += 32) {
+		auto v = _mm256_loadu_si256((const __m256i *)(p + i));
+		auto nl = _mm256_cmpeq_epi8(v, newline);
+		auto blank = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+		                             _mm256_cmpeq_epi8(v, tab));
+		masks.newline |= uint64_t(uint32_t(_mm256_movemask_epi8(nl))) << i;
+		masks.blank |= uint64_t(uint32_t(_mm256_movemask_epi8(blank))) << i;
+	}
+	return masks;
+}
+#elif defined(__SSE2__)
+BlockMasks scan_block(const char *p) {
+	auto newline = _mm_set1_epi8('\n');
+	auto space = _mm_set1_epi8(' ');
+	auto tab = _mm_set1_epi8('\t');
+	BlockMasks masks{0, 0};
+	for (int i = 0; i < 64; i += 16) {
+		auto v = _mm_loadu_si128((const __m128i *)(p + i));
+		auto nl = _mm_cmpeq_epi8(v, newline);
+		auto blank = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+		                          _mm_cmpeq_epi8(v, tab));
+		masks.newline |= uint64_t(_mm_movemask_epi8(nl)) << i;
+		masks.blank |= uint64_t(_mm_movemask_epi8(blank)) << i;
+	}
+	return masks;
+}
+#else
+BlockMasks scan_block(const char *p) {
+	return scan_block_scalar(p);
+}
+#endif
+
+void Header::flush_log() {
+	// Verbose output is collected per header and written with a single
+	// call so lines from headers built on other threads don't interleave.
+	if (log_buffer.empty()) {
+		return;
+	}
+	fwrite(log_buffer.data(), 1, log_buffer.size(), stdout);
+	log_buffer.clear();
+}
+
+Header::Header(const std::string &filename,
+               Source &&source, Options opt)
+	: filename{filename}, source{std::move(source)}, options{opt} {
+	nodes.emplace_back();
+	nodes[RootNode].kind = CXCursor_TranslationUnit;
+}
+
+std::string_view Header::text() const {
+	return source.text();
+}
+
+Node *Header::find(QualifiedName name) {
+	auto it = index.find(name);
+	return it == index.end() ? nullptr : &nodes[it->second];
+}
+
+NodeList Header::children(const Node &node) const {
+	return {child_ids.data() + node.children_begin,
+	        child_ids.data() + node.children_end};
+}
+
+NodeList Header::sorted_children(const Node &node) const {
+	return {sorted_ids.data() + node.children_begin,
+	        sorted_ids.data() + node.children_end};
+}
+
+void Header::remove_children(NodeId id) {
+	// Children are always stored after their parent, so one forward
+	// pass finds every descendant.
+	std::vector<bool> removed(nodes.size(), false);
+	removed[id] = true;
+	for (NodeId i = id + 1; i < nodes.size(); ++i) {
+		auto parent = nodes[i].parent;
+		if (parent != RemovedNode && removed[parent]) {
+			removed[i] = true;
+			index.erase(nodes[i].qualified_name);
+			nodes[i].parent = RemovedNode;
+		}
+	}
+}
+
+void Header::insert(const CXCursor &cursor, Node &&node) {
+	auto parent = clang_getCursorSemanticParent(cursor);
+	auto kind = clang_getCursorKind(parent);
+	if (isfunc(kind)) {
+		// Prevents variables declared inside functions to be added
+		return;
+	}
+	std::optional<QualifiedName> container;
+	if (iscontainer(kind)) {
+		container = names.get(parent);
+	}
+	insert(std::move(node), container);
+}
+
+void Header::insert(Node &&node, std::optional<QualifiedName> container) {
+	auto it = index.find(node.qualified_name);
+	if (it != index.end() && nodes[it->second].parent == RootNode) {
+		// Duplicare declaration, bias the documented declaration,
+		// if neither node is documented, bias the most recent declaration
+		auto &current = nodes[it->second];
+		if (current.doc_range) {
+			return;
+		}
+		if (current.children_end > 0) {
+			remove_children(it->second);
+		}
+		current = std::move(node);
+		return;
+	}
+	node.parent = RootNode;
+	if (container) {
+		auto parent_it = index.find(*container);
+		if (parent_it == index.end()) {
+			// Parent was declared outside of this header
+			return;
+		}
+		if (it != index.end()) {
+			// Members keep their first declaration
+			return;
+		}
+		node.parent = parent_it->second;
+	}
+	// Until link_children runs children_end only flags that a node
+	// has had children inserted.
+	nodes[node.parent].children_end = 1;
+
+	auto id = NodeId(nodes.size());
+	index.insert({node.qualified_name, id});
+	nodes.emplace_back(std::move(node));
+}
+
+void Header::clear() {
+	nodes.resize(1);
+	nodes[RootNode].children_end = 0;
+	index.clear();
+}
+
+void Header::link_children() {
+	// Counting sort of nodes by parent, which keeps each node's
+	// children contiguous and in declaration order.
+	for (auto &node : nodes) {
+		node.children_begin = node.children_end = 0;
+	}
+	for (NodeId id = 1; id < nodes.size(); ++id) {
+		if (nodes[id].parent != RemovedNode) {
+			++nodes[nodes[id].parent].children_end;
+		}
+	}
+	uint32_t offset = 0;
+	for (auto &node : nodes) {
+		auto count = node.children_end;
+		node.children_begin = node.children_end = offset;
+		offset += count;
+	}
+	child_ids.assign(offset, RootNode);
+	for (NodeId id = 1; id < nodes.size(); ++id) {
+		if (nodes[id].parent != RemovedNode) {
+			child_ids[nodes[nodes[id].parent].children_end++] = id;
+		}
+	}
+
+	sorted_ids = child_ids;
+	for (const auto &node : nodes) {
+		std::sort(sorted_ids.begin() + node.children_begin,
+		          sorted_ids.begin() + node.children_end,
+		          [this](NodeId lhs, NodeId rhs) {
+		              return nodes[lhs].qualified_name
+		                   < nodes[rhs].qualified_name;
+		          });
+	}
+}
+
+void Header::parse(CXTranslationUnit tu, bool from_disk) {
+	PhaseTimer timer{PhaseVisit};
+	this->from_disk = from_disk;
+	auto route = [this](CXSourceLocation loc) {
+		return clang_Location_isFromMainFile(loc) ? this : nullptr;
+	};
+	visit(tu, route);
+	finish_parse();
+}
+
+void Header::parse(CXTranslationUnit tu,
+                   const std::vector<Header *> &headers) {
+	PhaseTimer timer{PhaseVisit};
+	std::unordered_map<std::string, Header *> paths;
+	for (auto *header : headers) {
+		paths[absolute_path("", header->filename)] = header;
+		header->from_disk = true;
+	}
+
+	// Each file is looked up by path once, the same CXFile is returned
+	// for every location in it.
+	std::unordered_map<CXFile, Header *> files;
+	auto route = [&](CXSourceLocation loc) -> Header * {
+		CXFile file;
+		clang_getExpansionLocation(loc, &file, nullptr, nullptr, nullptr);
+		if (file == nullptr) {
+			return nullptr;
+		}
+		auto [it, inserted] = files.emplace(file, nullptr);
+		if (inserted) {
+			auto path = absolute_path(
+				"", take_string(clang_getFileName(file)));
+			auto header = paths.find(path);
+			if (header != paths.end()) {
+				it->second = header->second;
+			}
+		}
+		return it->second;
+	};
+	visit(tu, route);
+	for (auto *header : headers) {
+		header->finish_parse();
+	}
+}
+
+CXChildVisitResult Header::visit(const CXCursor &cursor, CXCursorKind kind,
+                                 CXChildVisitResult next) {
+	++cursors_visited;
+	if (!isdecl(kind) || !clang_isDeclaration(kind)) {
+		return next;
+	}
+
+	auto access = clang_getCXXAccessSpecifier(cursor);
+	auto src_range = clang_getCursorExtent(cursor);
+	auto loc_start = clang_getRangeStart(src_range);
+	auto loc_end = clang_getRangeEnd(src_range);
+
+	// Declarations written by a macro are placed where the macro is
+	// used, only possible when parsing with includes.
+	unsigned line_start, line_end;
+	clang_getExpansionLocation(loc_start, nullptr,
+	                           &line_start, nullptr, nullptr);
+
+	clang_getExpansionLocation(loc_end, nullptr,
+	                           &line_end, nullptr, nullptr);
+
+	line_start = source_line(line_start);
+	line_end = source_line(line_end);
+
+	auto name = clang_getCursorSpelling(cursor);
+	auto qname = names.get(cursor);
+
+	if (options.verbose) {
+		log("%s [%d-%d]: %s %s\n", filename.c_str(),
+		                            line_start, line_end,
+		                            decl_str(kind),
+		                            qname.c_str());
+	}
+
+	auto interned = intern(clang_getCString(name));
+	clang_disposeString(name);
+
+	SourceRange decl_range{line_start, line_end};
+	auto doc_range = options.raw_comments
+	               ? attached_doc(cursor, line_start)
+	               : find_doc(line_start);
+	insert(cursor, Node{interned, qname, kind, access,
+	                    decl_range, doc_range});
+	return next;
+}
+
+void Header::finish_parse() {
+	if (options.verbose) {
+		log("%s: visited %zu cursors\n", filename.c_str(), cursors_visited);
+	}
+	link_children();
+	flush_log();
+}
+
+unsigned Header::source_line(unsigned line) const {
+	// Lines are only shifted when libclang read the header from disk,
+	// otherwise it was given the stripped contents.
+	if (!from_disk || line == 0 || line > source.line_map.size()) {
+		return line;
+	}
+	return source.line_map[line - 1];
+}
+
+std::optional<SourceRange> Header::find_doc(unsigned linenum) const {
+	// Documentation is the block of comment lines ending on the
+	// declaration's own (1 based) line or the one directly above it.
+	if (linenum == 0 || linenum > source.comment_start.size()) {
+		return {};
+	}
+	for (unsigned end = linenum - 1, repeat = 0; repeat < 2; --end, ++repeat) {
+		auto start = source.comment_start[end];
+		if (start != Source::NoComment) {
+			return SourceRange{start, end};
+		}
+		if (end == 0) {
+			break;
+		}
+	}
+	return {};
+}
+
+std::optional<SourceRange> Header::attached_doc(const CXCursor &cursor,
+                                                unsigned linenum) const {
+	auto range = clang_Cursor_getCommentRange(cursor);
+	if (clang_Range_isNull(range)) {
+		return {};
+	}
+	unsigned start, end;
+	clang_getSpellingLocation(clang_getRangeStart(range), nullptr,
+	                          &start, nullptr, nullptr);
+	clang_getSpellingLocation(clang_getRangeEnd(range), nullptr,
+	                          &end, nullptr, nullptr);
+	start = source_line(start);
+	end = source_line(end);
+	if (start == 0 || end < start || end > source.lines.size()) {
+		return {};
+	}
+
+	// Trailing comments such as 'int x; ///< doc' share their line with
+	// code, which can't be separated line by line.
+	unsigned column;
+	clang_getSpellingLocation(clang_getRangeStart(range), nullptr,
+	                          nullptr, &column, nullptr);
+	auto line = source.lines[start - 1];
+	auto text = line;
+	ltrim(text, ' ', '\t');
+	if (column - 1 != line.size() - text.size()) {
+		return {};
+	}
+
+	// libclang only checks that no ';', '{' or '}' separates a comment
+	// from the declaration, so the comment above 'B' in 'A,\n B' would
+	// also be attached to 'B'. Only blank lines may come in between.
+	for (unsigned ln = end; ln + 1 < linenum && ln < source.lines.size(); ++ln) {
+		text = source.lines[ln];
+		ltrim(text, ' ', '\t');
+		if (!text.empty()) {
+			return {};
+		}
+	}
+	return SourceRange{start - 1, end - 1};
+}
+
+std::string Header::parse_source(unsigned start, unsigned end,
+                                 int indent) const {
+	assert(start > 0 && end <= source.lines.size());
+	std::string indent_str(indent, ' ');
+	std::string result;
+
+	for (unsigned i = (start - 1); i < end; ++i) {
+		auto line = source.lines[i];
+		ltrim(line, '\t');
+		rtrim(line, ';');
+
+		if (line.rfind('{') != std::string::npos) {
+			// The end position is the true ending of the declaration
+			// including the funciton body if it has any. We only want
+			// the declaration signature so we stop early if an opening
+			// brace is reached.
+			rtrim(line, '{', ' ');
+			result += indent_str;
+			result += line;
+			break;
+		}
+
+		result += indent_str;
+		result += line;
+		if (i < (end - 1)) {
+			result.push_back('\n');
+		}
+	}
+	return result;
+}
+
+std::string Header::parse_comment(const SourceRange &range) const {
+	std::string_view line;
+	std::string comment;
+	bool block = false;
+	bool space = false;
+
+	for (unsigned ln = range.line_start; ln <= range.line_end; ++ln) {
+		line = source.lines[ln];
+		ltrim(line, ' ','\t');
+
+		// C style comments only come from libclang's attached comments,
+		// find_doc never returns them.
+		bool c_style = block;
+		bool opening = false;
+		if (!block && line.rfind("/*", 0) == 0) {
+			c_style = block = opening = true;
+			line.remove_prefix(2);
+			ltrim(line, 1, '*', '!');
+		} else if (block && line.rfind("*/", 0) != 0) {
+			ltrim(line, 1, '*');
+		}
+
+		if (c_style) {
+			auto close = line.find("*/");
+			if (close != std::string_view::npos) {
+				line = line.substr(0, close);
+				rtrim(line, ' ', '\t');
+				block = false;
+			}
+			if (line.empty() && (opening || !block)) {
+				// Nothing besides the comment delimiters
+				continue;
+			}
+		} else {
+			ltrim(line, 3, '/');
+		}
+		ltrim(line, 1, ' ');
+
+		if (space) {
+			comment.push_back(' ');
+			space = false;
+		}
+		if (line.empty()) {
+			comment.push_back('\n');
+			comment.push_back('\n');
+			continue;
+		}
+		comment += line;
+		space = true;
+	}
+	return comment;
+}
+
+void Header::format_members(const Node &parent, int indent) {
+	// Children are stored in the order they were declared in the
+	// source, which is the order used when displaying the source of
+	// classes, structs, unions and enums.
+	std::unordered_set<unsigned> parsed_decl;
+	auto access = CX_CXXInvalidAccessSpecifier;
+
+	for (auto id : children(parent)) {
+		const auto *node = &nodes[id];
+		auto [line_start, line_end] = node->decl_range;
+
+		if (!options.include_private && node->access == CX_CXXPrivate) {
+			continue;
+		}
+
+		// Avoid duplicating lines that include multiple declarations
+		// as to not output 'float x, y;' twice for example.
+		if (parsed_decl.find(line_start) != parsed_decl.end()) {
+			continue;
+		}
+		parsed_decl.insert(line_start);
+		auto formatted = parse_source(line_start, line_end, indent);
+
+		auto semi = node->kind == CXCursor_EnumConstantDecl
+		          ? "" : ";";
+		auto lf = node->kind == CXCursor_EnumConstantDecl
+		          ? "" : "\n";
+
+		if (node->access != access) {
+			// public is default for structs so it is not included
+			if (node->access == CX_CXXPublic && isclass(parent.kind)) {
+				code.append("public:\n");
+			} else if (node->access == CX_CXXProtected) {
+				code.append("protected:\n");
+			} else if (node->access == CX_CXXPrivate) {
+				code.append("private:\n");
+			}
+			access = node->access;
+		}
+
+		code.append("%s%s%s\n", formatted.c_str(), semi, lf);
+	}
+	auto last = code.last_append();
+	if (code.size() - last > 1 && code[code.size() - 2] == '\n') {
+		// Remove extra line ending
+		code.pop_back();
+	}
+}
+
+void Header::format_fields(const Node &parent) {
+	fields.clear();
+	for (auto id : sorted_children(parent)) {
+		const auto *node = &nodes[id];
+		if (node->kind != CXCursor_FieldDecl || !node->doc_range) {
+			continue;
+		}
+		fields.push_back({node->name,
+		                  parse_comment(node->doc_range.value())});
+	}
+}
+
+void Header::render(const std::vector<Renderer *> &renderers,
+                    FragmentCache *cache) {
+	PhaseTimer timer{PhaseRender};
+	ProfileFile::count(nodes.size() - 1, cursors_visited);
+	for (auto *renderer : renderers) {
+		renderer->begin(filename);
+	}
+	render_sections(renderers, cache);
+
+	if (options.build_toc) {
+		render_toc(renderers, nodes[RootNode], 0);
+	}
+}
+
+void Header::render_toc(const std::vector<Renderer *> &renderers,
+                        const Node &parent, int depth) {
+	for (auto id : sorted_children(parent)) {
+		const auto *node = &nodes[id];
+		if (!node->doc_range && !iscontainer(node->kind)) {
+			continue;
+		}
+
+		if (node->kind == CXCursor_FieldDecl) {
+			// Cannot have a link to a member variable
+			continue;
+		}
+
+		auto kstr = decl_str(node->kind);
+		if (kstr == nullptr || node->name.empty()) {
+			continue;
+		}
+		for (auto *renderer : renderers) {
+			renderer->toc_entry(*node, kstr, depth);
+		}
+		if (node->child_count() > 0) {
+			render_toc(renderers, *node, depth + 1);
+		}
+	}
+}
+
+// Whether a node gets a section of its own, and if so whether it is
+// rendered as a container with its members.
+bool Header::renderable(const Node &node, bool &container) const {
+	if (decl_str(node.kind) == nullptr) {
+		// Non printable declaration
+		return false;
+	}
+
+	if (!options.include_private && node.access == CX_CXXPrivate) {
+		return false;
+	}
+
+	// Checking if start != end ensures we don't try to add children
+	// to a one line declaration. For example take 'enum Enum {A, B};',
+	// since the child declarations already appear on the same line
+	// where the parent was declared we don't want to include them again.
+	auto [line_start, line_end] = node.decl_range;
+	container = iscontainer(node.kind) && line_start != line_end;
+
+	// Only declarations that have comments will be documented,
+	// containers with children are never excluded.
+	return container
+	    || (node.doc_range && node.kind != CXCursor_FieldDecl);
+}
+
+void Header::render_sections(const std::vector<Renderer *> &renderers,
+                             FragmentCache *cache) {
+	bool lines_matter = std::any_of(renderers.begin(), renderers.end(),
+	                                [](const Renderer *renderer) {
+	                                    return renderer->uses_lines();
+	                                });
+	// Overloads share a qualified name, sections are told apart by kind
+	// and by how many with the same name came before them.
+	std::unordered_map<std::string, unsigned> seen;
+	std::vector<size_t> starts(renderers.size());
+	std::string key;
+
+	for (auto id : sorted_children(nodes[RootNode])) {
+		const auto &node = nodes[id];
+		bool container;
+		if (!renderable(node, container)) {
+			continue;
+		}
+		for (auto *renderer : renderers) {
+			renderer->begin_section();
+		}
+		if (cache == nullptr) {
+			render_decl(renderers, node, 0, container);
+			continue;
+		}
+
+		key = node.qualified_name.str();
+		key.push_back('\0');
+		key += std::to_string(node.kind);
+		key.push_back('\0');
+		key += std::to_string(seen[key]++);
+
+		FragmentCache::Fragment fragment;
+		section_hash(node, fragment.content_hash, fragment.line_hash);
+
+		auto *cached = cache->find(key);
+		if (cached != nullptr
+		    && cached->content_hash == fragment.content_hash
+		    && (!lines_matter || cached->line_hash == fragment.line_hash)
+		    && cached->outputs.size() == renderers.size()) {
+			for (size_t i = 0; i < renderers.size(); ++i) {
+				renderers[i]->body().append(cached->outputs[i]);
+			}
+			cache->add(key, std::move(*cached));
+			++cache->reused;
+			continue;
+		}
+
+		for (size_t i = 0; i < renderers.size(); ++i) {
+			starts[i] = renderers[i]->body().size();
+		}
+		render_decl(renderers, node, 0, container);
+		for (size_t i = 0; i < renderers.size(); ++i) {
+			const auto &body = renderers[i]->body();
+			fragment.outputs.emplace_back(body.data() + starts[i],
+			                              body.size() - starts[i]);
+		}
+		cache->add(key, std::move(fragment));
+		++cache->rendered;
+	}
+}
+
+void Header::render(const std::vector<Renderer *> &renderers,
+                    const Node &parent, int depth) {
+	for (auto id : sorted_children(parent)) {
+		const auto &node = nodes[id];
+		bool container;
+		if (renderable(node, container)) {
+			render_decl(renderers, node, depth, container);
+		}
+	}
+}
+
+void Header::render_decl(const std::vector<Renderer *> &renderers,
+                         const Node &node, int depth, bool container) {
+	auto [line_start, line_end] = node.decl_range;
+	auto formatted = parse_source(line_start, line_end, 0);
+	code.clear();
+	if (container) {
+		code.append("%s {\n", formatted.c_str());
+		format_members(node, 4);
+		code.append("};\n");
+		format_fields(node);
+	} else {
+		auto semi = node.kind == CXCursor_EnumConstantDecl
+		          ? "" : ";";
+		code.append("%s%s\n", formatted.c_str(), semi);
+		fields.clear();
+	}
+	std::string comment;
+	if (node.doc_range) {
+		comment = parse_comment(node.doc_range.value());
+	}
+
+	RenderDecl decl{node, decl_str(node.kind), depth, container,
+	                {code.data(), code.size()}, comment};
+	for (auto *renderer : renderers) {
+		renderer->begin_decl(decl, fields);
+	}
+	if (container) {
+		render(renderers, node, depth + 1);
+	}
+	for (auto *renderer : renderers) {
+		renderer->end_decl(decl);
+	}
+}
+
+void MarkdownRenderer::begin(const std::string &filename) {
+	output.toc.append("# %s\n\n", filename.c_str());
+}
+
+void MarkdownRenderer::toc_entry(const Node &node, const char *kind,
+                                 int depth) {
+	output.toc.append("%*s* [%s](#%s-%s)\n", depth*4, "",
+	                  node.name.c_str(), kind,
+	                  node.qualified_name.c_str());
+}
+
+void MarkdownRenderer::begin_decl(const RenderDecl &decl,
+                                  const std::vector<RenderField> &fields) {
+	auto &body = output.body;
+	auto pre = decl.depth == 0 ? "##" : "###";
+	body.append("%s %s `%s`\n\n", pre, decl.kind,
+	            decl.node.qualified_name.c_str());
+	body.append("```cpp\n");
+	body.append(decl.code);
+	body.append("```\n");
+
+	if (decl.node.doc_range) {
+		body.append(decl.comment);
+		body.append("\n\n");
+	}
+	if (!fields.empty()) {
+		body.append("#### Member Variables\n");
+		for (const auto &field : fields) {
+			body.append("* `%s`  %s\n", field.name.c_str(),
+			            field.comment.c_str());
+		}
+		body.append("\n");
+	}
+}
+
+void MarkdownRenderer::end_decl(const RenderDecl &decl) {
+	if (decl.container && decl.depth == 0) {
+		output.body.append("\n---\n\n");
+	}
+}
+
+const Output &MarkdownRenderer::finish() {
+	if (build_toc) {
+		output.toc.append("\n---\n\n");
+	}
+	return output;
+}
+
+void append_html(Buffer &buffer, std::string_view text) {
+	size_t start = 0;
+	for (size_t i = 0; i < text.size(); ++i) {
+		const char *entity;
+		switch (text[i]) {
+		case '<': entity = "&lt;"; break;
+		case '>': entity = "&gt;"; break;
+		case '&': entity = "&amp;"; break;
+		case '"': entity = "&quot;"; break;
+		default: continue;
+		}
+		buffer.append(text.substr(start, i - start));
+		buffer.append(entity);
+		start = i + 1;
+	}
+	buffer.append(text.substr(start));
+}
+
+void HtmlRenderer::begin(const std::string &filename) {
+	auto &toc = output.toc;
+	toc.append("<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n");
+	toc.append("<title>");
+	append_html(toc, filename);
+	toc.append("</title>\n</head>\n<body>\n<h1>");
+	append_html(toc, filename);
+	toc.append("</h1>\n");
+}
+
+void HtmlRenderer::append_anchor(const char *kind, const Node &node) {
+	append_html(output.body, kind);
+	output.body.append("-");
+	append_html(output.body, node.qualified_name.str());
+}
+
+void HtmlRenderer::toc_entry(const Node &node, const char *kind,
+                             int depth) {
+	// Items stay open so nested lists end up inside their parent item
+	auto &toc = output.toc;
+	if (toc_lists == depth + 1) {
+		toc.append("</li>\n");
+	}
+	for (; toc_lists < depth + 1; ++toc_lists) {
+		toc.append("\n<ul>\n");
+	}
+	for (; toc_lists > depth + 1; --toc_lists) {
+		toc.append("</li>\n</ul>\n</li>\n");
+	}
+	toc.append("<li><a href=\"#");
+	append_html(toc, kind);
+	toc.append("-");
+	append_html(toc, node.qualified_name.str());
+	toc.append("\">");
+	append_html(toc, node.name.str());
+	toc.append("</a>");
+}
+
+void HtmlRenderer::begin_decl(const RenderDecl &decl,
+                              const std::vector<RenderField> &fields) {
+	auto &body = output.body;
+	auto heading = decl.depth == 0 ? 2 : 3;
+	body.append("<section id=\"");
+	append_anchor(decl.kind, decl.node);
+	body.append("\">\n<h%d>%s <code>", heading, decl.kind);
+	append_html(body, decl.node.qualified_name.str());
+	body.append("</code></h%d>\n<pre><code class=\"language-cpp\">",
+	            heading);
+	append_html(body, decl.code);
+	body.append("</code></pre>\n");
+
+	// Blank lines separate paragraphs in comments
+	auto comment = decl.comment;
+	while (!comment.empty()) {
+		auto end = comment.find("\n\n");
+		body.append("<p>");
+		append_html(body, comment.substr(0, end));
+		body.append("</p>\n");
+		if (end == std::string_view::npos) {
+			break;
+		}
+		comment.remove_prefix(end + 2);
+	}
+	if (!fields.empty()) {
+		body.append("<h4>Member Variables</h4>\n<ul>\n");
+		for (const auto &field : fields) {
+			body.append("<li><code>");
+			append_html(body, field.name.str());
+			body.append("</code> ");
+			append_html(body, field.comment);
+			body.append("</li>\n");
+		}
+		body.append("</ul>\n");
+	}
+}
+
+void HtmlRenderer::end_decl(const RenderDecl &) {
+	output.body.append("</section>\n");
+}
+
+const Output &HtmlRenderer::finish() {
+	for (; toc_lists > 0; --toc_lists) {
+		output.toc.append("</li>\n</ul>\n");
+	}
+	output.body.append("</body>\n</html>\n");
+	return output;
+}
+
+void append_json(Buffer &buffer, std::string_view text) {
+	buffer.append("\"");
+	size_t start = 0;
+	for (size_t i = 0; i < text.size(); ++i) {
+		auto c = (unsigned char)text[i];
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+		buffer.append(text.substr(start, i - start));
+		switch (c) {
+		case '"':  buffer.append("\\\""); break;
+		case '\\': buffer.append("\\\\"); break;
+		case '\n': buffer.append("\\n"); break;
+		case '\t': buffer.append("\\t"); break;
+		default:   buffer.append("\\u%04x", unsigned(c)); break;
+		}
+		start = i + 1;
+	}
+	buffer.append(text.substr(start));
+	buffer.append("\"");
+}
+
+void JsonRenderer::begin(const std::string &filename) {
+	output.body.append("{\"file\": ");
+	append_json(output.body, filename);
+	output.body.append(", \"declarations\": [");
+	empty.push_back(true);
+}
+
+void JsonRenderer::separate() {
+	output.body.append(empty.back() ? "\n" : ",\n");
+	empty.back() = false;
+}
+
+void JsonRenderer::begin_section() {
+	separate();
+}
+
+void JsonRenderer::begin_decl(const RenderDecl &decl,
+                              const std::vector<RenderField> &fields) {
+	auto &body = output.body;
+	if (decl.depth > 0) {
+		separate();
+	}
+
+	body.append("{\"kind\": ");
+	append_json(body, decl.kind);
+	body.append(", \"name\": ");
+	append_json(body, decl.node.name.str());
+	body.append(", \"qualified_name\": ");
+	append_json(body, decl.node.qualified_name.str());
+
+	const char *access = nullptr;
+	switch (decl.node.access) {
+	case CX_CXXPublic:    access = "public"; break;
+	case CX_CXXProtected: access = "protected"; break;
+	case CX_CXXPrivate:   access = "private"; break;
+	default: break;
+	}
+	if (access != nullptr) {
+		body.append(", \"access\": \"%s\"", access);
+	}
+	body.append(", \"line\": %u, \"code\": ", decl.node.decl_range.line_start);
+	append_json(body, decl.code);
+	if (decl.node.doc_range) {
+		body.append(", \"comment\": ");
+		append_json(body, decl.comment);
+	}
+	if (!fields.empty()) {
+		body.append(", \"fields\": [");
+		for (size_t i = 0; i < fields.size(); ++i) {
+			body.append(i == 0 ? "{\"name\": " : ", {\"name\": ");
+			append_json(body, fields[i].name.str());
+			body.append(", \"comment\": ");
+			append_json(body, fields[i].comment);
+			body.append("}");
+		}
+		body.append("]");
+	}
+	if (decl.container) {
+		body.append(", \"members\": [");
+		empty.push_back(true);
+	}
+}
+
+void JsonRenderer::end_decl(const RenderDecl &decl) {
+	if (decl.container) {
+		empty.pop_back();
+		output.body.append("]");
+	}
+	output.body.append("}");
+}
+
+const Output &JsonRenderer::finish() {
+	output.body.append(empty.back() ? "]}\n" : "\n]}\n");
+	return output;
+}
+
+std::unique_ptr<Renderer> make_renderer(Format format,
+                                        const Options &options) {
+	switch (format) {
+	case FormatHtml: return std::make_unique<HtmlRenderer>();
+	case FormatJson: return std::make_unique<JsonRenderer>();
+	default:         return std::make_unique<MarkdownRenderer>(options);
+	}
+}
+
+bool isopen(const Token &tok) {
+	return tok.kind == Token::Punct
+	    && (tok.text == "(" || tok.text == "[" || tok.text == "{");
+}
+
+bool isclose(const Token &tok) {
+	return tok.kind == Token::Punct
+	    && (tok.text == ")" || tok.text == "]" || tok.text == "}");
+}
+
+bool tokenize(std::string_view text, std::vector<Token> &tokens) {
+	auto is = [](char c, uint8_t cls) {
+		return char_table[(unsigned char)c] & cls;
+	};
+	auto isident = [&is](char c) {
+		return is(c, CharIdent);
+	};
+	std::vector<uint32_t> open;
+	unsigned line = 1;
+	size_t i = 0;
+	tokens.reserve(text.size() / 4);
+
+	while (i < text.size()) {
+		char c = text[i];
+		if (c == '\n') {
+			++line;
+			++i;
+			continue;
+		}
+		if (is(c, CharSpace)) {
+			++i;
+			continue;
+		}
+		if (text.compare(i, 2, "//") == 0) {
+			i = std::min(text.find('\n', i), text.size());
+			continue;
+		}
+		if (text.compare(i, 2, "/*") == 0) {
+			auto end = text.find("*/", i + 2);
+			if (end == std::string_view::npos) {
+				return false;
+			}
+			line += std::count(text.begin() + i, text.begin() + end, '\n');
+			i = end + 2;
+			continue;
+		}
+
+		auto start = i;
+		auto kind = Token::Punct;
+		if (is(c, CharDigit)
+		    || (c == '.' && i + 1 < text.size() && is(text[i + 1], CharDigit))) {
+			kind = Token::Literal;
+			while (i < text.size()
+			       && (isident(text[i]) || text[i] == '.' || text[i] == '\'')) {
+				auto exp = text[i] | 0x20;
+				if ((exp == 'e' || exp == 'p') && i + 1 < text.size()
+				    && (text[i + 1] == '+' || text[i + 1] == '-')) {
+					++i;
+				}
+				++i;
+			}
+		} else if (isident(c)) {
+			kind = Token::Identifier;
+			while (i < text.size() && isident(text[i])) {
+				++i;
+			}
+			if (i < text.size() && (text[i] == '"' || text[i] == '\'')) {
+				// Encoding prefix of a character or string literal
+				if (text[i - 1] == 'R') {
+					return false;
+				}
+				kind = Token::Literal;
+				c = text[i];
+			}
+		}
+		if (c == '"' || c == '\'') {
+			kind = Token::Literal;
+			for (++i; i < text.size() && text[i] != c; ++i) {
+				if (text[i] == '\\') {
+					++i;
+				} else if (text[i] == '\n') {
+					return false;
+				}
+			}
+			if (i >= text.size()) {
+				return false;
+			}
+			++i;
+		} else if (kind == Token::Punct) {
+			i += text.compare(i, 3, "...") == 0 ? 3
+			   : text.compare(i, 2, "::") == 0
+			     || text.compare(i, 2, "->") == 0 ? 2 : 1;
+		}
+
+		auto id = uint32_t(tokens.size());
+		tokens.push_back(Token{kind, line, text.substr(start, i - start)});
+		auto &tok = tokens.back();
+		if (isopen(tok)) {
+			open.push_back(id);
+		} else if (isclose(tok)) {
+			if (open.empty()) {
+				return false;
+			}
+			auto &opener = tokens[open.back()];
+			auto pair = std::string_view{"()[]{}"}.find(opener.text[0]);
+			if (tok.text[0] != "()[]{}"[pair + 1]) {
+				return false;
+			}
+			opener.match = id;
+			tok.match = open.back();
+			open.pop_back();
+		}
+	}
+	tokens.push_back(Token{Token::End, line, {}});
+	return open.empty();
+}
+
+bool FastParser::parse() {
+	if (!tokenize(header.source.text(), tokens)) {
+		return false;
+	}
+	Scope root{CXCursor_TranslationUnit, {}, {}, CX_CXXInvalidAccessSpecifier};
+	if (!parse_scope(root) || peek().kind != Token::End) {
+		return false;
+	}
+
+	// Consistency check, every declaration has to be renderable from
+	// the lines it claims to cover.
+	for (NodeId id = 1; id < header.nodes.size(); ++id) {
+		auto [line_start, line_end] = header.nodes[id].decl_range;
+		if (line_start == 0 || line_start > line_end
+		    || line_end >= header.source.lines.size()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+unsigned FastParser::line() const {
+	return pos < tokens.size() ? tokens[pos].line : 0;
+}
+
+size_t FastParser::token_count() const {
+	return tokens.size();
+}
+
+bool FastParser::parse_scope(Scope &scope) {
+	// Parses declarations up to the closing brace of the scope, or the
+	// end of the file for the translation unit.
+	while (peek().kind != Token::End && peek().text != "}") {
+		if (!parse_statement(scope)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool FastParser::parse_statement(Scope &scope) {
+	const auto &tok = peek();
+	auto line_start = tok.line;
+
+	if (tok.text == ";") {
+		++pos;
+		return true;
+	}
+	if (iscontainer(scope.kind) && peek(1).text == ":") {
+		auto access = tok.text == "public"    ? CX_CXXPublic
+		            : tok.text == "protected" ? CX_CXXProtected
+		            : tok.text == "private"   ? CX_CXXPrivate
+		            : CX_CXXInvalidAccessSpecifier;
+		if (access != CX_CXXInvalidAccessSpecifier) {
+			scope.access = access;
+			pos += 2;
+			return true;
+		}
+	}
+	if (!iscontainer(scope.kind)) {
+		if (tok.text == "namespace"
+		    || (tok.text == "inline" && peek(1).text == "namespace")) {
+			return parse_namespace(scope);
+		}
+		if (tok.text == "extern" && peek(1).kind == Token::Literal) {
+			// Linkage specs are only transparent at file scope, inside a
+			// namespace libclang adds an empty name to qualified names.
+			if (scope.kind != CXCursor_TranslationUnit) {
+				return false;
+			}
+			pos += 2;
+			if (peek().text != "{") {
+				return parse_statement(scope);
+			}
+			auto close = peek().match;
+			++pos;
+			if (!parse_scope(scope) || pos != close) {
+				return false;
+			}
+			++pos;
+			return true;
+		}
+	}
+	if (tok.text == "static_assert") {
+		if (!skip_until({";"})) {
+			return false;
+		}
+		++pos;
+		return true;
+	}
+
+	bool templated = false;
+	if (tok.text == "template") {
+		// Explicit specializations and instantiations are named after
+		// their template, only libclang can tell them apart.
+		if (peek(1).text != "<" || peek(2).text == ">") {
+			return false;
+		}
+		++pos;
+		if (!skip_angles()) {
+			return false;
+		}
+		templated = true;
+	}
+
+	const auto &first = peek();
+	if (first.text == "using") {
+		return parse_using(scope, line_start, templated);
+	}
+	if (first.text == "typedef") {
+		return !templated && parse_typedef(scope, line_start);
+	}
+	if (first.text == "class" || first.text == "struct"
+	    || first.text == "union") {
+		return parse_record(scope, line_start, templated);
+	}
+	if (first.text == "enum") {
+		return !templated && parse_enum(scope, line_start);
+	}
+	return parse_member(scope, line_start, templated);
+}
+
+bool FastParser::parse_namespace(const Scope &scope) {
+	if (peek().text == "inline") {
+		++pos;
+	}
+	++pos;
+
+	auto name = scope.name;
+	for (;;) {
+		// Anonymous namespaces have a generated name
+		if (peek().kind != Token::Identifier || isreserved(peek().text)) {
+			return false;
+		}
+		name = qualify(name, peek().text);
+		++pos;
+		if (peek().text != "::") {
+			break;
+		}
+		++pos;
+		if (peek().text == "inline") {
+			++pos;
+		}
+	}
+	if (peek().text == "=") {
+		// Namespace alias
+		if (!skip_until({";"})) {
+			return false;
+		}
+		++pos;
+		return true;
+	}
+	if (peek().text != "{") {
+		return false;
+	}
+	auto close = peek().match;
+	++pos;
+
+	Scope inner{CXCursor_Namespace, name, {}, CX_CXXInvalidAccessSpecifier};
+	if (!parse_scope(inner) || pos != close) {
+		return false;
+	}
+	++pos;
+	return true;
+}
+
+bool FastParser::parse_using(const Scope &scope, unsigned line_start,
+                             bool templated) {
+	++pos;
+	if (peek().text == "namespace") {
+		if (templated || !skip_until({";"})) {
+			return false;
+		}
+		++pos;
+		return true;
+	}
+	if (peek().kind == Token::Identifier && peek(1).text == "=") {
+		auto name = peek().text;
+		pos += 2;
+		if (!skip_until({";"})) {
+			return false;
+		}
+		auto kind = templated ? CXCursor_TypeAliasTemplateDecl
+		                      : CXCursor_TypeAliasDecl;
+		add(container_of(scope), qualify(scope.name, name), name, kind,
+		    scope.access, {line_start, tokens[pos - 1].line});
+		++pos;
+		return true;
+	}
+	if (templated) {
+		return false;
+	}
+
+	// Using declaration, 'using Base::member;' is named after the member
+	std::string_view name;
+	for (; peek().text != ";"; ++pos) {
+		const auto &tok = peek();
+		if (tok.kind == Token::Identifier && !isreserved(tok.text)) {
+			name = tok.text;
+		} else if (tok.text != "::" && tok.text != "typename") {
+			return false;
+		}
+	}
+	if (name.empty()) {
+		return false;
+	}
+	add(container_of(scope), qualify(scope.name, name), name,
+	    CXCursor_UsingDeclaration, scope.access,
+	    {line_start, tokens[pos - 1].line});
+	++pos;
+	return true;
+}
+
+bool FastParser::parse_typedef(const Scope &scope, unsigned line_start) {
+	++pos;
+	auto begin = pos;
+	if (!skip_until({";", "{"}) || peek().text != ";") {
+		// Types defined inside of a typedef are visited through it
+		return false;
+	}
+
+	std::string_view name;
+	int angles = 0;
+	for (auto i = begin; i < pos; ++i) {
+		const auto &tok = tokens[i];
+		if (tok.text == "<") {
+			++angles;
+		} else if (tok.text == ">") {
+			--angles;
+		} else if (isopen(tok) && angles > 0) {
+			i = tok.match;
+		} else if (angles > 0) {
+			continue;
+		} else if (tok.text == "(") {
+			// Function pointer, 'typedef void (*name)(int);'
+			auto j = i + 1;
+			while (tokens[j].text == "*" || tokens[j].text == "&") {
+				++j;
+			}
+			if (j + 1 != tok.match || tokens[j].kind != Token::Identifier) {
+				return false;
+			}
+			name = tokens[j].text;
+			break;
+		} else if (tok.text == "[") {
+			break;
+		} else if (tok.text == ",") {
+			return false;
+		} else if (tok.text == "class" || tok.text == "struct"
+		           || tok.text == "union" || tok.text == "enum") {
+			return false;
+		} else if (tok.kind == Token::Identifier) {
+			name = tok.text;
+		}
+	}
+	if (name.empty() || isreserved(name) || isspecifier(name)) {
+		return false;
+	}
+	add(container_of(scope), qualify(scope.name, name), name,
+	    CXCursor_TypedefDecl, scope.access, {line_start, tokens[pos - 1].line});
+	++pos;
+	return true;
+}
+
+bool FastParser::parse_record(const Scope &scope, unsigned line_start,
+                              bool templated) {
+	auto keyword = peek().text;
+	auto kind = keyword == "class"  ? CXCursor_ClassDecl
+	          : keyword == "struct" ? CXCursor_StructDecl
+	          : CXCursor_UnionDecl;
+	++pos;
+
+	// Anonymous records are named after their location by libclang
+	if (peek().kind != Token::Identifier || isreserved(peek().text)) {
+		return false;
+	}
+	auto name = peek().text;
+	++pos;
+
+	if (templated) {
+		kind = CXCursor_ClassTemplate;
+	}
+	if (peek().text == "<") {
+		if (!templated || !skip_angles()) {
+			return false;
+		}
+		kind = CXCursor_ClassTemplatePartialSpecialization;
+	}
+	if (peek().text == "final") {
+		++pos;
+	}
+
+	auto qname = qualify(scope.name, name);
+	if (peek().text == ";") {
+		add(container_of(scope), qname, name, kind, scope.access,
+		    {line_start, tokens[pos - 1].line});
+		++pos;
+		return true;
+	}
+	if (peek().text == ":" && !skip_until({"{", ";"})) {
+		return false;
+	}
+	if (peek().text != "{") {
+		return false;
+	}
+	auto close = peek().match;
+	add(container_of(scope), qname, name, kind, scope.access,
+	    {line_start, tokens[close].line});
+	++pos;
+
+	Scope inner{kind, qname, name, keyword == "class" ? CX_CXXPrivate
+	                                                 : CX_CXXPublic};
+	if (!parse_scope(inner) || pos != close) {
+		return false;
+	}
+	++pos;
+	return end_record();
+}
+
+bool FastParser::parse_enum(const Scope &scope, unsigned line_start) {
+	++pos;
+	if (peek().text == "class" || peek().text == "struct") {
+		++pos;
+	}
+	if (peek().kind != Token::Identifier || isreserved(peek().text)) {
+		return false;
+	}
+	auto name = peek().text;
+	auto qname = qualify(scope.name, name);
+	++pos;
+
+	if (peek().text == ":") {
+		++pos;
+		if (!skip_until({"{", ";"})) {
+			return false;
+		}
+	}
+	if (peek().text == ";") {
+		add(container_of(scope), qname, name, CXCursor_EnumDecl,
+		    scope.access, {line_start, tokens[pos - 1].line});
+		++pos;
+		return true;
+	}
+	if (peek().text != "{") {
+		return false;
+	}
+	auto close = peek().match;
+	add(container_of(scope), qname, name, CXCursor_EnumDecl, scope.access,
+	    {line_start, tokens[close].line});
+	++pos;
+
+	while (pos != close) {
+		const auto &constant = peek();
+		if (constant.kind != Token::Identifier || isreserved(constant.text)) {
+			return false;
+		}
+		++pos;
+		if (peek().text == "=") {
+			++pos;
+			if (!skip_initializer()) {
+				return false;
+			}
+		}
+		if (peek().text == ",") {
+			++pos;
+		} else if (pos != close) {
+			return false;
+		}
+		// Constants have the same access as their enum
+		add(qname, qualify(qname, constant.text), constant.text,
+		    CXCursor_EnumConstantDecl, scope.access,
+		    {constant.line, tokens[pos - 1].line});
+	}
+	++pos;
+	return end_record();
+}
+
+bool FastParser::end_record() {
+	// 'struct A { ... } a;' also declares a variable, a missing semicolon
+	// is recovered from the same way clang does.
+	const auto &next = peek();
+	if (next.text == ";") {
+		++pos;
+		return true;
+	}
+	if (next.text == "*" || next.text == "&") {
+		return false;
+	}
+	if (next.kind == Token::Identifier) {
+		auto after = peek(1).text;
+		return after != ";" && after != "," && after != "=" && after != "["
+		    && after != "(" && after != "{" && after != ":";
+	}
+	return true;
+}
+
+bool FastParser::parse_member(const Scope &scope, unsigned line_start,
+                              bool templated) {
+	// Functions, variables and fields. The declarator name is the token
+	// before the first of '(', '=', ';', ',', '[', ':' or '{' outside of
+	// template arguments.
+	auto begin = pos;
+	auto i = pos;
+	for (int angles = 0;; ++i) {
+		const auto &tok = tokens[i];
+		if (tok.kind == Token::End || isclose(tok)) {
+			return false;
+		}
+		if (tok.text == "<") {
+			++angles;
+		} else if (tok.text == ">") {
+			if (--angles < 0) {
+				return false;
+			}
+		} else if (angles > 0) {
+			if (tok.text == ";") {
+				return false;
+			}
+			if (isopen(tok)) {
+				i = tok.match;
+			}
+		} else if (tok.text == "operator") {
+			break;
+		} else if (tok.text == "(" || tok.text == "=" || tok.text == ";"
+		           || tok.text == "," || tok.text == "[" || tok.text == ":"
+		           || tok.text == "{") {
+			if (i == begin || tokens[i - 1].kind != Token::Identifier) {
+				return false;
+			}
+			--i;
+			break;
+		}
+	}
+
+	auto name_pos = i;
+	std::string_view name = tokens[i].text;
+	if (name == "operator") {
+		// Operator names are spelled without spaces, 'operator=='
+		scratch = name;
+		++i;
+		if (tokens[i].text == "(" && tokens[i + 1].text == ")") {
+			scratch += "()";
+			i += 2;
+		}
+		for (; tokens[i].text != "("; ++i) {
+			if (tokens[i].text == "[" && tokens[i].match == i + 1) {
+				scratch += "[]";
+				++i;
+				continue;
+			}
+			if (tokens[i].kind != Token::Punct || isopen(tokens[i])
+			    || isclose(tokens[i])) {
+				return false;
+			}
+			scratch += tokens[i].text;
+		}
+		if (scratch.size() == name.size()) {
+			return false;
+		}
+		name = intern(scratch).str();
+		pos = i;
+	} else {
+		if (isreserved(name) || isspecifier(name) || isbuiltin(name)) {
+			return false;
+		}
+		pos = i + 1;
+	}
+
+	auto name_begin = name_pos;
+	bool dtor = name_begin > begin && tokens[name_begin - 1].text == "~";
+	if (dtor) {
+		--name_begin;
+	}
+	auto qual_begin = name_begin;
+	while (qual_begin >= begin + 2 && tokens[qual_begin - 1].text == "::"
+	       && tokens[qual_begin - 2].kind == Token::Identifier) {
+		qual_begin -= 2;
+	}
+	if (qual_begin > begin && tokens[qual_begin - 1].text == "::") {
+		return false;
+	}
+
+	bool has_type = false;
+	bool is_static = false;
+	for (auto j = begin; j < qual_begin; ++j) {
+		const auto &tok = tokens[j];
+		if (isopen(tok)) {
+			// Attributes, 'alignas(...)' and friends
+			return false;
+		}
+		if (tok.kind != Token::Identifier) {
+			continue;
+		}
+		if (isreserved(tok.text) || tok.text == "class"
+		    || tok.text == "struct" || tok.text == "union"
+		    || tok.text == "enum") {
+			return false;
+		}
+		is_static |= tok.text == "static";
+		has_type |= !isspecifier(tok.text);
+	}
+
+	// Declarations such as 'void Class::member() {}' belong to the class
+	// they name, which has to be declared in this header.
+	auto container = container_of(scope);
+	auto parent = scope.name;
+	auto class_name = scope.spelling;
+	bool qualified = qual_begin != name_begin;
+	if (qualified) {
+		if (iscontainer(scope.kind)) {
+			return false;
+		}
+		container = resolve(scope, qual_begin, name_begin - 1);
+		if (!container) {
+			return false;
+		}
+		parent = *container;
+		class_name = tokens[name_begin - 2].text;
+	}
+	bool member = container.has_value();
+	auto access = iscontainer(scope.kind) ? scope.access
+	                                      : CX_CXXInvalidAccessSpecifier;
+
+	if (peek().text != "(") {
+		if (templated || dtor || !has_type) {
+			return false;
+		}
+		auto kind = member && !is_static && !qualified ? CXCursor_FieldDecl
+		                                               : CXCursor_VarDecl;
+		return parse_fields(line_start, container, parent, access,
+		                    name_pos, kind);
+	}
+
+	bool ctor = member && !dtor && name == class_name;
+	if (dtor) {
+		if (!member || name != class_name) {
+			return false;
+		}
+		scratch = "~";
+		scratch += name;
+		name = intern(scratch).str();
+	}
+	if (!has_type && !ctor && !dtor) {
+		// Most likely a macro
+		return false;
+	}
+	if ((ctor || dtor) && (scope.kind == CXCursor_ClassTemplate
+	    || scope.kind == CXCursor_ClassTemplatePartialSpecialization)) {
+		// Spelled with template arguments by some libclang versions
+		return false;
+	}
+	const auto &param = peek(1);
+	if (param.kind == Token::Literal || param.text == "*"
+	    || param.text == "&") {
+		// 'T value(1, 2);' is a variable
+		return false;
+	}
+	auto kind = templated ? CXCursor_FunctionTemplate
+	          : ctor      ? CXCursor_Constructor
+	          : dtor      ? CXCursor_Destructor
+	          : member    ? CXCursor_CXXMethod
+	          : CXCursor_FunctionDecl;
+
+	unsigned line_end;
+	if (!parse_function(line_end, ctor)) {
+		return false;
+	}
+	add(container, qualify(parent, name), name, kind, access,
+	    {line_start, line_end});
+	return true;
+}
+
+bool FastParser::parse_function(unsigned &line_end, bool ctor) {
+	// Parameters, qualifiers and trailing return type, followed by a
+	// body, an '= default' style definition or a semicolon.
+	pos = peek().match + 1;
+	unsigned initializers = 0;
+	for (;;) {
+		const auto &tok = peek();
+		if (tok.kind == Token::End || isclose(tok) || tok.text == "try"
+		    || tok.text == "requires" || tok.text == "[") {
+			return false;
+		}
+		if (tok.text == ";") {
+			line_end = tokens[pos - 1].line;
+			++pos;
+			return true;
+		}
+		if (tok.text == "{") {
+			// Bodies are skipped, the same as SkipFunctionBodies does,
+			// which also leaves out member initializers.
+			line_end = initializers ? initializers : tokens[pos - 1].line;
+			pos = tok.match + 1;
+			return true;
+		}
+		if (tok.text == "=") {
+			if (!skip_until({";"})) {
+				return false;
+			}
+			line_end = tokens[pos - 1].line;
+			++pos;
+			return true;
+		}
+		if (tok.text == ":") {
+			if (!ctor) {
+				return false;
+			}
+			// Member initializers, 'x{x}' is not the body
+			initializers = tokens[pos - 1].line;
+			for (++pos;; ++pos) {
+				while (peek().kind == Token::Identifier || peek().text == "::") {
+					++pos;
+				}
+				if (peek().text == "<" && !skip_angles()) {
+					return false;
+				}
+				if (peek().text != "(" && peek().text != "{") {
+					return false;
+				}
+				pos = peek().match + 1;
+				if (peek().text == "...") {
+					++pos;
+				}
+				if (peek().text != ",") {
+					break;
+				}
+			}
+			if (peek().text != "{") {
+				return false;
+			}
+			continue;
+		}
+		if (tok.text == "<") {
+			if (!skip_angles()) {
+				return false;
+			}
+			continue;
+		}
+		pos = isopen(tok) ? tok.match + 1 : pos + 1;
+	}
+}
+
+bool FastParser::parse_fields(unsigned line_start,
+                              std::optional<QualifiedName> container,
+                              QualifiedName parent,
+                              CX_CXXAccessSpecifier access,
+                              size_t name_pos, CXCursorKind kind) {
+	// One node per declarator of 'int a, *b = nullptr, c[4];', each
+	// starting at the beginning of the declaration.
+	for (;;) {
+		auto name = tokens[name_pos].text;
+		for (bool done = false; !done;) {
+			const auto &tok = peek();
+			if (tok.text == "[" || tok.text == "{") {
+				pos = tok.match + 1;
+			} else if (tok.text == "=") {
+				++pos;
+				if (!skip_initializer()) {
+					return false;
+				}
+			} else if (tok.text == ":" && kind == CXCursor_FieldDecl) {
+				// Bit field width
+				++pos;
+				if (!skip_initializer()) {
+					return false;
+				}
+			} else if (tok.text == "," || tok.text == ";") {
+				done = true;
+			} else {
+				return false;
+			}
+		}
+		add(container, qualify(parent, name), name, kind, access,
+		    {line_start, tokens[pos - 1].line});
+
+		if (peek().text == ";") {
+			++pos;
+			return true;
+		}
+		++pos;
+		while (peek().text == "*" || peek().text == "&"
+		       || peek().text == "const") {
+			++pos;
+		}
+		if (peek().kind != Token::Identifier || isreserved(peek().text)) {
+			return false;
+		}
+		name_pos = pos++;
+	}
+}
+
+bool FastParser::skip_angles() {
+	// Skips template arguments or parameters starting at '<'
+	for (int depth = 0;; ++pos) {
+		const auto &tok = peek();
+		if (tok.kind == Token::End || isclose(tok) || tok.text == ";") {
+			return false;
+		}
+		if (tok.text == "<") {
+			++depth;
+		} else if (tok.text == ">" && --depth == 0) {
+			++pos;
+			return true;
+		} else if (isopen(tok)) {
+			pos = tok.match;
+		}
+	}
+}
+
+bool FastParser::skip_until(std::initializer_list<std::string_view> stops) {
+	// Advances to the first of stops outside of brackets, without
+	// leaving the enclosing brackets.
+	for (;; ++pos) {
+		const auto &tok = peek();
+		if (tok.kind == Token::End) {
+			return false;
+		}
+		if (tok.kind == Token::Punct
+		    && std::find(stops.begin(), stops.end(), tok.text) != stops.end()) {
+			return true;
+		}
+		if (isclose(tok)) {
+			return false;
+		}
+		if (isopen(tok)) {
+			pos = tok.match;
+		}
+	}
+}
+
+bool FastParser::skip_initializer() {
+	// Initializers end at the next ',' which is ambiguous once template
+	// arguments are involved, 'a = b<c, d>()'. Shifts are fine.
+	for (;; ++pos) {
+		const auto &tok = peek();
+		if (tok.text == "<" && peek(1).text == "<") {
+			++pos;
+			continue;
+		}
+		if (tok.kind == Token::End || tok.text == "<") {
+			return false;
+		}
+		if (tok.text == "," || tok.text == ";" || isclose(tok)) {
+			return true;
+		}
+		if (isopen(tok)) {
+			pos = tok.match;
+		}
+	}
+}
+
+std::optional<QualifiedName> FastParser::resolve(const Scope &scope,
+                                                 size_t begin, size_t end) {
+	// Looks up a qualifier such as 'A::B' the way name lookup would,
+	// from the innermost enclosing namespace outwards.
+	std::string qualifier;
+	for (auto i = begin; i < end; ++i) {
+		qualifier += tokens[i].text;
+	}
+	std::string_view outer = scope.name.str();
+	for (;;) {
+		scratch = outer;
+		if (!scratch.empty()) {
+			scratch += "::";
+		}
+		scratch += qualifier;
+		auto *node = header.find(intern(scratch));
+		if (node != nullptr) {
+			if (!iscontainer(node->kind)) {
+				return {};
+			}
+			return node->qualified_name;
+		}
+		if (outer.empty()) {
+			return {};
+		}
+		auto sep = outer.rfind("::");
+		outer = sep == std::string_view::npos ? std::string_view{}
+		                                      : outer.substr(0, sep);
+	}
+}
+
+QualifiedName FastParser::qualify(QualifiedName parent,
+                                  std::string_view name) {
+	scratch = parent.str();
+	if (!scratch.empty()) {
+		scratch += "::";
+	}
+	scratch += name;
+	return intern(scratch);
+}
+
+void FastParser::add(std::optional<QualifiedName> container,
+                     QualifiedName qname, std::string_view spelling,
+                     CXCursorKind kind, CX_CXXAccessSpecifier access,
+                     SourceRange range) {
+	if (header.options.verbose) {
+		header.log("%s [%d-%d]: %s %s\n", header.filename.c_str(),
+		                                   range.line_start, range.line_end,
+		                                   decl_str(kind), qname.c_str());
+	}
+	auto doc_range = header.find_doc(range.line_start);
+	header.insert(Node{intern(spelling), qname, kind, access,
+	                   range, doc_range}, container);
+}
+
+std::optional<QualifiedName> FastParser::container_of(const Scope &scope) {
+	if (iscontainer(scope.kind)) {
+		return scope.name;
+	}
+	return {};
+}
+
+const Token &FastParser::peek(size_t n) const {
+	return tokens[std::min(pos + n, tokens.size() - 1)];
+}
+
+bool FastParser::isreserved(std::string_view word) {
+	// Keywords that can't start or be part of a declaration the parser
+	// understands.
+	static constexpr std::string_view words[] = {
+		"alignas", "alignof", "asm", "break", "case", "catch", "co_await",
+		"co_return", "co_yield", "concept", "continue", "decltype",
+		"default", "delete", "do", "else", "export", "for", "friend",
+		"goto", "if", "import", "module", "namespace", "new", "operator",
+		"private", "protected", "public", "requires", "return", "sizeof",
+		"static_assert", "switch", "template", "this", "throw", "try",
+		"typedef", "typeid", "using", "while", "__attribute__",
+		"__declspec",
+	};
+	return std::find(std::begin(words), std::end(words), word)
+	    != std::end(words);
+}
+
+bool FastParser::isspecifier(std::string_view word) {
+	// Declaration specifiers that aren't part of the type
+	static constexpr std::string_view words[] = {
+		"const", "consteval", "constexpr", "constinit", "explicit",
+		"extern", "inline", "mutable", "register", "static",
+		"thread_local", "virtual", "volatile",
+	};
+	return std::find(std::begin(words), std::end(words), word)
+	    != std::end(words);
+}
+
+bool FastParser::isbuiltin(std::string_view word) {
+	static constexpr std::string_view words[] = {
+		"auto", "bool", "char", "char16_t", "char32_t", "char8_t",
+		"double", "float", "int", "long", "short", "signed", "unsigned",
+		"void", "wchar_t",
+	};
+	return std::find(std::begin(words), std::end(words), word)
+	    != std::end(words);
+}
+
+bool Header::parse_fast() {
+	PhaseTimer timer{PhaseVisit};
+	if (options.raw_comments) {
+		// Comments are attached by libclang in this mode
+		return false;
+	}
+	FastParser parser{*this};
+	if (!parser.parse()) {
+		clear();
+		log_buffer.clear();
+		if (options.verbose) {
+			log("%s: unsupported declaration at line %u, using libclang\n",
+			    filename.c_str(), parser.line());
+		}
+		flush_log();
+		return false;
+	}
+	if (options.verbose) {
+		log("%s: parsed %zu tokens without libclang\n", filename.c_str(),
+		    parser.token_count());
+	}
+	link_children();
+	flush_log();
+	return true;
+}
+
+uint64_t hash_bytes(const char *data, size_t size,
+                    uint64_t hash) {
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= (unsigned char)data[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+uint64_t parse_hash(const std::string &filename, const Options &options,
+                    const std::vector<std::string> *arguments) {
+	auto hash = hash_bytes(filename.data(), filename.size());
+	char flags[] = {char(options.raw_comments), char(options.fast),
+	                char(options.umbrella)};
+	hash = hash_bytes(flags, sizeof(flags), hash);
+	if (arguments != nullptr) {
+		for (const auto &arg : *arguments) {
+			hash = hash_bytes(arg.data(), arg.size() + 1, hash);
+		}
+	}
+	return hash;
+}
+
+uint64_t options_hash(const std::string &filename, const Options &options,
+                      const std::vector<std::string> *arguments) {
+	auto hash = parse_hash(filename, options, arguments);
+	char flags[] = {char(options.include_private), char(options.build_toc),
+	                char(options.formats)};
+	return hash_bytes(flags, sizeof(flags), hash);
+}
+
+void Manifest::load(const std::string &output_dir) {
+	path = output_dir == "" ? Filename : output_dir + "/" + Filename;
+	entries.clear();
+
+	std::ifstream infile{path};
+	std::string line;
+	while (std::getline(infile, line)) {
+		unsigned long long input, opts;
+		int n = 0;
+		if (sscanf(line.c_str(), "%llx %llx %n", &input, &opts, &n) != 2
+		    || n == 0) {
+			continue;
+		}
+		entries[line.substr(n)] = Entry{input, opts};
+	}
+}
+
+bool Manifest::save() const {
+	std::lock_guard<std::mutex> lock{mutex};
+	if (!dirty) {
+		return true;
+	}
+	std::ofstream outfile{path};
+	for (const auto &[output, entry] : entries) {
+		char hashes[40];
+		snprintf(hashes, sizeof(hashes), "%016llx %016llx ",
+		         (unsigned long long)entry.input_hash,
+		         (unsigned long long)entry.options_hash);
+		outfile << hashes << output << '\n';
+	}
+	return bool(outfile);
+}
+
+bool Manifest::unchanged(const std::string &output,
+                         const Entry &entry) const {
+	std::lock_guard<std::mutex> lock{mutex};
+	auto it = entries.find(output);
+	if (it == entries.end()) {
+		return false;
+	}
+	return it->second.input_hash == entry.input_hash
+	    && it->second.options_hash == entry.options_hash;
+}
+
+void Manifest::update(const std::string &output, const Entry &entry) {
+	std::lock_guard<std::mutex> lock{mutex};
+	entries[output] = entry;
+	dirty = true;
+}
+
+void Manifest::remove(const std::string &output) {
+	std::lock_guard<std::mutex> lock{mutex};
+	dirty |= entries.erase(output) > 0;
+}
+
+bool write_output(const std::string &path, const Output &output) {
+	PhaseTimer timer{PhaseWrite};
+	const Buffer *segments[] = {&output.toc, &output.body};
+
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		struct stat pathinfo;
+		bool same = fstat(fd, &pathinfo) == 0
+		         && size_t(pathinfo.st_size) == output.size();
+		std::vector<char> existing;
+		for (auto *segment : segments) {
+			if (!same || segment->empty()) {
+				continue;
+			}
+			existing.resize(segment->size());
+			auto n = read(fd, existing.data(), existing.size());
+			same = n == ssize_t(existing.size())
+			    && memcmp(existing.data(), segment->data(), n) == 0;
+		}
+		close(fd);
+		if (same) {
+			return true;
+		}
+	}
+
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	iovec iov[2];
+	int count = 0;
+	for (auto *segment : segments) {
+		if (!segment->empty()) {
+			iov[count].iov_base = const_cast<char *>(segment->data());
+			iov[count].iov_len = segment->size();
+			++count;
+		}
+	}
+	bool ok = true;
+	for (int i = 0; i < count && ok;) {
+		auto n = writev(fd, iov + i, count - i);
+		if (n < 0) {
+			ok = errno == EINTR;
+			continue;
+		}
+		// Skip past whatever a short write managed to get out
+		for (; i < count && size_t(n) >= iov[i].iov_len; ++i) {
+			n -= iov[i].iov_len;
+		}
+		if (i < count) {
+			iov[i].iov_base = (char *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+	return close(fd) == 0 && ok;
+}
+
+void Profiler::print_stats() const {
+	std::lock_guard<std::mutex> lock{mutex};
+	std::vector<const FileStats *> sorted;
+	FileStats total{"total"};
+	for (const auto &stats : files) {
+		sorted.push_back(&stats);
+		for (int i = 0; i < PhaseCount; ++i) {
+			total.wall[i] += stats.wall[i];
+			total.cpu[i] += stats.cpu[i];
+		}
+		total.nodes += stats.nodes;
+		total.cursors += stats.cursors;
+	}
+	std::stable_sort(sorted.begin(), sorted.end(),
+	                 [](const FileStats *lhs, const FileStats *rhs) {
+	                     return lhs->name < rhs->name;
+	                 });
+	sorted.push_back(&total);
+
+	printf("\nwall/cpu ms per phase\n%-32s", "file");
+	for (int i = 0; i < PhaseCount; ++i) {
+		printf(" %17s", phase_str(Phase(i)));
+	}
+	printf(" %8s %8s\n", "nodes", "cursors");
+	for (const auto *stats : sorted) {
+		printf("%-32s", stats->name.c_str());
+		for (int i = 0; i < PhaseCount; ++i) {
+			printf(" %8.2f/%-8.2f", stats->wall[i] / 1e6, stats->cpu[i] / 1e6);
+		}
+		printf(" %8zu %8zu\n", stats->nodes, stats->cursors);
+	}
+	printf("run took %.2fms\n", (clock_ns(CLOCK_MONOTONIC) - epoch) / 1e6);
+	if (cpu_clock == CLOCK_THREAD_CPUTIME_ID) {
+		printf("cpu times leave out libclang's parser threads, "
+		       "use -j 1 to include them\n");
+	}
+}
+
+void Profiler::print_memory() const {
+	std::lock_guard<std::mutex> lock{mutex};
+	std::vector<const FileStats *> sorted;
+	FileStats total{"total"};
+	for (const auto &stats : files) {
+		sorted.push_back(&stats);
+		for (int i = 0; i < PhaseCount; ++i) {
+			total.allocations[i] += stats.allocations[i];
+			total.allocated[i] += stats.allocated[i];
+		}
+	}
+	std::stable_sort(sorted.begin(), sorted.end(),
+	                 [](const FileStats *lhs, const FileStats *rhs) {
+	                     return lhs->name < rhs->name;
+	                 });
+
+	printf("\noperator new calls/kB per phase\n%-32s", "file");
+	for (int i = 0; i < PhaseCount; ++i) {
+		printf(" %19s", phase_str(Phase(i)));
+	}
+	printf(" %10s\n", "peak kB");
+	for (const auto *stats : sorted) {
+		printf("%-32s", stats->name.c_str());
+		for (int i = 0; i < PhaseCount; ++i) {
+			printf(" %9llu/%-9llu", (unsigned long long)stats->allocations[i],
+			       (unsigned long long)(stats->allocated[i] / 1024));
+		}
+		printf(" %10zu\n", stats->peak_rss);
+	}
+	printf("%-32s", total.name.c_str());
+	for (int i = 0; i < PhaseCount; ++i) {
+		printf(" %9llu/%-9llu", (unsigned long long)total.allocations[i],
+		       (unsigned long long)(total.allocated[i] / 1024));
+	}
+	printf("\noperator new outside any phase: %llu calls, "
+	       "%llu kB\n",
+	       (unsigned long long)unattributed_count.load(),
+	       (unsigned long long)(unattributed_bytes.load() / 1024));
+
+	// Highest peak first, ties in name order to keep the list stable
+	std::stable_sort(sorted.begin(), sorted.end(),
+	                 [](const FileStats *lhs, const FileStats *rhs) {
+	                     return lhs->peak_rss > rhs->peak_rss;
+	                 });
+	sorted.resize(std::min(sorted.size(), worst_files));
+	printf("highest peak RSS:\n");
+	for (const auto *stats : sorted) {
+		printf("%10zu kB  %s\n", stats->peak_rss, stats->name.c_str());
+	}
+}
+
+bool Profiler::write_trace(const std::string &path) const {
+	std::unique_lock<std::mutex> lock{mutex};
+	Output output;
+	auto &body = output.body;
+	body.append("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	for (uint32_t i = 0; i < threads; ++i) {
+		body.append("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+		            "\"tid\": %u, \"args\": {\"name\": \"thread %u\"}},\n",
+		            i, i);
+	}
+	for (size_t i = 0; i < events.size(); ++i) {
+		const auto &event = events[i];
+		body.append("{\"name\": \"%s\", \"cat\": \"phase\", \"ph\": \"X\", "
+		            "\"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, "
+		            "\"args\": {\"file\": ",
+		            phase_str(event.phase), event.thread,
+		            event.start / 1e3, event.duration / 1e3);
+		append_json(body, files[event.file].name);
+		body.append(i + 1 < events.size() ? "}},\n" : "}}\n");
+	}
+	body.append("]}\n");
+
+	// Writing is timed like any other output
+	lock.unlock();
+	return write_output(path, output);
+}
+
+MappedFile::MappedFile(const std::string &path) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	struct stat pathinfo;
+	if (fstat(fd, &pathinfo) == 0 && pathinfo.st_size > 0) {
+		auto *ptr = mmap(nullptr, pathinfo.st_size, PROT_READ,
+		                 MAP_PRIVATE, fd, 0);
+		if (ptr != MAP_FAILED) {
+			madvise(ptr, pathinfo.st_size, MADV_SEQUENTIAL);
+			data = static_cast<const char *>(ptr);
+			size = pathinfo.st_size;
+		}
+	}
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (data != nullptr) {
+		munmap(const_cast<char *>(data), size);
+	}
+}
+
+bool Header::save(const std::string &path, uint64_t parse_hash) const {
+	// Names are written once each, nodes refer to them by offset
+	std::string strings;
+	std::unordered_map<Name, uint32_t, Name::Hash> offsets;
+	auto string_offset = [&](Name name) {
+		auto [it, inserted] = offsets.emplace(name, uint32_t(strings.size()));
+		if (inserted) {
+			strings += name.str();
+			strings.push_back('\0');
+		}
+		return it->second;
+	};
+
+	std::vector<DbNode> records;
+	records.reserve(nodes.size());
+	for (const auto &node : nodes) {
+		auto doc = node.doc_range.value_or(SourceRange{0, 0});
+		records.push_back({string_offset(node.name),
+		                   string_offset(node.qualified_name),
+		                   int32_t(node.kind), uint32_t(node.access),
+		                   node.decl_range.line_start,
+		                   node.decl_range.line_end,
+		                   uint32_t(node.doc_range.has_value()),
+		                   doc.line_start, doc.line_end,
+		                   node.parent,
+		                   node.children_begin, node.children_end});
+	}
+	strings.resize((strings.size() + 3) & ~size_t(3));
+
+	DbHeader header;
+	memcpy(header.magic, DbHeader::Magic, sizeof(header.magic));
+	header.version = DbHeader::Version;
+	header.input_hash = source.hash;
+	header.parse_hash = parse_hash;
+	header.node_count = uint32_t(nodes.size());
+	header.child_count = uint32_t(child_ids.size());
+	header.line_count = uint32_t(source.lines.size());
+	header.string_size = uint32_t(strings.size());
+
+	auto bytes = [](const auto &data, size_t size) {
+		return std::string_view{reinterpret_cast<const char *>(data), size};
+	};
+	Output output;
+	output.body.append(bytes(&header, sizeof(header)));
+	output.body.append(bytes(records.data(), records.size() * sizeof(DbNode)));
+	output.body.append(bytes(child_ids.data(),
+	                         child_ids.size() * sizeof(NodeId)));
+	output.body.append(bytes(sorted_ids.data(),
+	                         sorted_ids.size() * sizeof(NodeId)));
+	output.body.append(strings);
+	return write_output(path, output);
+}
+
+bool Header::load(const std::string &path, uint64_t parse_hash) {
+	PhaseTimer timer{PhaseVisit};
+	MappedFile file{path};
+	auto data = file.view();
+	if (data.size() < sizeof(DbHeader)) {
+		return false;
+	}
+	const auto *header = reinterpret_cast<const DbHeader *>(data.data());
+	if (memcmp(header->magic, DbHeader::Magic, sizeof(header->magic)) != 0
+	    || header->version != DbHeader::Version
+	    || header->input_hash != source.hash
+	    || header->parse_hash != parse_hash
+	    || header->line_count != source.lines.size()
+	    || header->node_count == 0) {
+		return false;
+	}
+	size_t node_count = header->node_count;
+	size_t child_count = header->child_count;
+	size_t size = sizeof(DbHeader) + node_count * sizeof(DbNode)
+	            + 2 * child_count * sizeof(NodeId) + header->string_size;
+	if (size != data.size()) {
+		return false;
+	}
+	const auto *records = reinterpret_cast<const DbNode *>(header + 1);
+	const auto *ids = reinterpret_cast<const NodeId *>(records + node_count);
+	const char *strings = reinterpret_cast<const char *>(
+		ids + 2 * child_count);
+	std::string_view string_data{strings, header->string_size};
+
+	// The file could have been written by anything, everything is bounds
+	// checked before it is used.
+	auto name = [&](uint32_t offset, Name &out) {
+		if (offset >= string_data.size()) {
+			return false;
+		}
+		auto str = string_data.substr(offset);
+		auto end = str.find('\0');
+		if (end == std::string_view::npos) {
+			return false;
+		}
+		out = intern(str.substr(0, end));
+		return true;
+	};
+	// Declarations are 1 based lines, comments are 0 based indices into
+	// source.lines. Bounds are compared in 64 bits so nothing wraps. The
+	// root stands in for the translation unit and has no lines.
+	auto decl_lines = [&](const DbNode &record) {
+		uint64_t start = record.decl_start, end = record.decl_end;
+		return 1 <= start && start <= end && end <= source.lines.size();
+	};
+	auto doc_lines = [&](const DbNode &record) {
+		uint64_t start = record.doc_start, end = record.doc_end;
+		return start <= end && end < source.lines.size();
+	};
+	for (size_t i = 0; i < 2 * child_count; ++i) {
+		if (ids[i] >= node_count) {
+			return false;
+		}
+	}
+
+	std::vector<Node> loaded(node_count);
+	for (size_t i = 0; i < node_count; ++i) {
+		const auto &record = records[i];
+		auto &node = loaded[i];
+		if (!name(record.name, node.name)
+		    || !name(record.qualified_name, node.qualified_name)
+		    || (i != RootNode && !decl_lines(record))
+		    || (record.has_doc && !doc_lines(record))
+		    || record.kind < 0 || record.kind > CXCursor_LastExtraDecl
+		    || record.access > CX_CXXPrivate
+		    || record.children_begin > record.children_end
+		    || record.children_end > child_count
+		    || (record.parent >= node_count && record.parent != RemovedNode)) {
+			return false;
+		}
+		node.kind = CXCursorKind(record.kind);
+		node.access = CX_CXXAccessSpecifier(record.access);
+		node.decl_range = {record.decl_start, record.decl_end};
+		if (record.has_doc) {
+			node.doc_range = SourceRange{record.doc_start, record.doc_end};
+		}
+		node.parent = record.parent;
+		node.children_begin = record.children_begin;
+		node.children_end = record.children_end;
+	}
+
+	// Parents are always stored before their children, which also rules
+	// out cycles when the tree is walked.
+	for (size_t i = 0; i < node_count; ++i) {
+		for (auto list : {ids, ids + child_count}) {
+			for (auto k = loaded[i].children_begin;
+			     k < loaded[i].children_end; ++k) {
+				if (list[k] <= i || loaded[list[k]].parent != i) {
+					return false;
+				}
+			}
+		}
+	}
+
+	nodes = std::move(loaded);
+	child_ids.assign(ids, ids + child_count);
+	sorted_ids.assign(ids + child_count, ids + 2 * child_count);
+	index.clear();
+	return true;
+}
+
+void Header::section_hash(const Node &node, uint64_t &content,
+                          uint64_t &lines) const {
+	// Everything the section is rendered from: names, kinds, access,
+	// and the declaration and comment lines of the node and its members.
+	// Line numbers are hashed on their own, only some formats show them.
+	auto hash_lines = [&](size_t first, size_t last) {
+		last = std::min(last, source.lines.size());
+		for (auto i = first; i < last; ++i) {
+			content = hash_bytes(source.lines[i].data(),
+			                     source.lines[i].size(), content);
+			content = hash_bytes("\n", 1, content);
+		}
+	};
+	auto name = node.qualified_name.str();
+	uint32_t info[] = {uint32_t(node.kind), uint32_t(node.access),
+	                   uint32_t(node.doc_range.has_value())};
+	content = hash_bytes(name.c_str(), name.size() + 1, content);
+	content = hash_bytes(reinterpret_cast<const char *>(info),
+	                     sizeof(info), content);
+
+	auto doc = node.doc_range.value_or(SourceRange{});
+	uint32_t numbers[] = {node.decl_range.line_start, node.decl_range.line_end,
+	                      doc.line_start, doc.line_end};
+	lines = hash_bytes(reinterpret_cast<const char *>(numbers),
+	                   sizeof(numbers), lines);
+
+	if (node.decl_range.line_start > 0) {
+		hash_lines(node.decl_range.line_start - 1, node.decl_range.line_end);
+	}
+	if (node.doc_range) {
+		hash_lines(doc.line_start, doc.line_end + 1);
+	}
+	for (auto id : children(node)) {
+		section_hash(nodes[id], content, lines);
+	}
+}
+
+void FragmentCache::begin(uint64_t hash) {
+	if (hash != render_hash) {
+		previous.clear();
+		render_hash = hash;
+	}
+	current.clear();
+	reused = rendered = 0;
+}
+
+FragmentCache::Fragment *FragmentCache::find(const std::string &key) {
+	auto it = previous.find(key);
+	return it == previous.end() ? nullptr : &it->second;
+}
+
+void FragmentCache::add(const std::string &key, Fragment &&fragment) {
+	current[key] = std::move(fragment);
+}
+
+void FragmentCache::end() {
+	previous = std::move(current);
+	current.clear();
+}
+
+// Fragments on disk: a magic number, version, render hash and count,
+// then for each fragment its key, hashes and one output per renderer,
+// strings stored as a 32-bit length followed by the bytes.
+bool FragmentCache::save(const std::string &path) const {
+	Output output;
+	auto &body = output.body;
+	auto put = [&body](const auto &value) {
+		body.append(std::string_view{reinterpret_cast<const char *>(&value),
+		                             sizeof(value)});
+	};
+	auto put_string = [&](std::string_view str) {
+		put(uint32_t(str.size()));
+		body.append(str);
+	};
+	body.append("PFR1");
+	put(render_hash);
+	put(uint32_t(previous.size()));
+	for (const auto &[key, fragment] : previous) {
+		put_string(key);
+		put(fragment.content_hash);
+		put(fragment.line_hash);
+		put(uint32_t(fragment.outputs.size()));
+		for (const auto &str : fragment.outputs) {
+			put_string(str);
+		}
+	}
+	return write_output(path, output);
+}
+
+bool FragmentCache::load(const std::string &path) {
+	MappedFile file{path};
+	auto data = file.view();
+	auto get = [&data](auto &value) {
+		if (data.size() < sizeof(value)) {
+			return false;
+		}
+		memcpy(&value, data.data(), sizeof(value));
+		data.remove_prefix(sizeof(value));
+		return true;
+	};
+	auto get_string = [&](std::string &str) {
+		uint32_t size;
+		if (!get(size) || data.size() < size) {
+			return false;
+		}
+		str.assign(data.data(), size);
+		data.remove_prefix(size);
+		return true;
+	};
+	if (data.substr(0, 4) != "PFR1") {
+		return false;
+	}
+	data.remove_prefix(4);
+
+	uint64_t hash;
+	uint32_t count;
+	if (!get(hash) || !get(count)) {
+		return false;
+	}
+	std::unordered_map<std::string, Fragment> loaded;
+	std::string key;
+	for (uint32_t i = 0; i < count; ++i) {
+		Fragment fragment;
+		uint32_t outputs;
+		if (!get_string(key) || !get(fragment.content_hash)
+		    || !get(fragment.line_hash) || !get(outputs)
+		    || outputs > data.size()) {
+			return false;
+		}
+		fragment.outputs.resize(outputs);
+		for (auto &str : fragment.outputs) {
+			if (!get_string(str)) {
+				return false;
+			}
+		}
+		loaded[key] = std::move(fragment);
+	}
+	render_hash = hash;
+	previous = std::move(loaded);
+	return true;
+}
+
+Source read_source(const std::string &filename) {
+	PhaseTimer timer{PhaseRead};
+	MappedFile file{filename};
+	return make_source(file.view());
+}
+
+Source make_source(std::string_view text) {
+	Source source;
+	source.hash = hash_bytes(text.data(), text.size());
+
+	std::vector<LineInfo> lines;
+	scan_lines<scan_block>(text, lines);
+
+	// Lines are sliced out of the stripped copy only once it is complete
+	// so growing the buffer can't invalidate them.
+	std::vector<std::pair<size_t, size_t>> offsets;
+	source.contents.reserve(text.size());
+	source.comment_start.reserve(lines.size());
+	source.line_map.reserve(lines.size());
+
+	for (const auto &line : lines) {
+		source.line_map.push_back(uint32_t(offsets.size() + 1));
+		if (line.kind == LineKind::Preprocessor) {
+			// Ideally this step is not necessary but libclang
+			// doesn't seem to traverse files with lots of includes.
+			continue;
+		}
+		auto index = uint32_t(offsets.size());
+		auto start = Source::NoComment;
+		if (line.kind == LineKind::Comment) {
+			bool continues = index > 0
+			    && source.comment_start[index - 1] != Source::NoComment;
+			start = continues ? source.comment_start[index - 1] : index;
+		}
+		source.comment_start.push_back(start);
+
+		offsets.emplace_back(source.contents.size(), line.length);
+		source.contents.insert(source.contents.end(),
+		                       text.begin() + line.offset,
+		                       text.begin() + line.offset + line.length);
+		source.contents.push_back('\n');
+	}
+
+	source.lines.reserve(offsets.size());
+	for (auto [offset, size] : offsets) {
+		source.lines.emplace_back(source.contents.data() + offset, size);
+	}
+	return source;
+}
+
+// Contents to parse instead of the file on disk. An empty view may have
+// no data, libclang is given an empty string for it.
+static unsigned unsaved_file(const std::string &filename,
+                             std::optional<std::string_view> contents,
+                             CXUnsavedFile &unsaved) {
+	if (!contents) {
+		return 0;
+	}
+	unsaved = {filename.c_str(), contents->empty() ? "" : contents->data(),
+	           (unsigned long)contents->size()};
+	return 1;
+}
+
+TranslationUnit parse_translation_unit(
+		CXIndex index, const std::string &filename,
+		std::optional<std::string_view> contents, const Options &options,
+		const std::vector<std::string> *arguments) {
+	PhaseTimer timer{PhaseParse};
+	// Without -fparse-all-comments libclang only attaches '///' and
+	// '/**' style comments to declarations.
+	std::vector<const char *> args{"-x", "c++"};
+	if (options.raw_comments) {
+		args.push_back("-fparse-all-comments");
+	}
+	unsigned flags = CXTranslationUnit_SkipFunctionBodies;
+	CXUnsavedFile unsaved{};
+	unsigned num_unsaved = unsaved_file(filename, contents, unsaved);
+
+	if (arguments != nullptr) {
+		for (const auto &arg : *arguments) {
+			args.push_back(arg.c_str());
+		}
+		// Keeps the parsed includes around so reparsing after an edit
+		// only has to parse the header itself.
+		if (options.watch) {
+			flags |= CXTranslationUnit_PrecompiledPreamble;
+		}
+	}
+	return TranslationUnit{clang_parseTranslationUnit(
+		index, filename.c_str(),
+		args.data(), int(args.size()),
+		&unsaved, num_unsaved,
+		flags)};
+}
+
+bool reparse_translation_unit(TranslationUnit &tu,
+                              const std::string &filename,
+                              std::optional<std::string_view> contents) {
+	PhaseTimer timer{PhaseParse};
+	CXUnsavedFile unsaved{};
+	unsigned num_unsaved = unsaved_file(filename, contents, unsaved);
+
+	auto err = clang_reparseTranslationUnit(
+		tu.get(), num_unsaved, &unsaved,
+		clang_defaultReparseOptions(tu.get()));
+	if (err != 0) {
+		tu.reset();
+		return false;
+	}
+	return true;
+}
+
+CompileCommands::~CompileCommands() {
+	for (size_t i = 0; preambles && i < commands.size(); ++i) {
+		if (!preambles[i].path.empty()) {
+			unlink(preambles[i].path.c_str());
+		}
+	}
+}
+
+// Number of leading directories two absolute paths share
+static size_t common_components(std::string_view a, std::string_view b) {
+	size_t count = 0;
+	for (;;) {
+		auto a_sep = a.find('/'), b_sep = b.find('/');
+		if (a.substr(0, a_sep) != b.substr(0, b_sep)) {
+			return count;
+		}
+		if (a_sep != 0) {
+			++count;
+		}
+		if (a_sep == std::string_view::npos
+		    || b_sep == std::string_view::npos) {
+			return count;
+		}
+		a.remove_prefix(a_sep + 1);
+		b.remove_prefix(b_sep + 1);
+	}
+}
+
+bool CompileCommands::load(const std::string &build_dir,
+                           const std::vector<std::string> &filenames,
+                           const Options &options) {
+	CXCompilationDatabase_Error err;
+	auto db = clang_CompilationDatabase_fromDirectory(build_dir.c_str(),
+	                                                  &err);
+	if (err != CXCompilationDatabase_NoError) {
+		return false;
+	}
+	struct Entry {
+		std::string source;
+		std::vector<std::string> arguments;
+	};
+	std::vector<Entry> entries;
+
+	auto all = clang_CompilationDatabase_getAllCompileCommands(db);
+	for (unsigned i = 0; i < clang_CompileCommands_getSize(all); ++i) {
+		auto command = clang_CompileCommands_getCommand(all, i);
+		auto directory = take_string(clang_CompileCommand_getDirectory(command));
+		auto source = absolute_path(
+			directory, take_string(clang_CompileCommand_getFilename(command)));
+		entries.push_back({source,
+		                   filter_arguments(command, directory, source)});
+	}
+	clang_CompileCommands_dispose(all);
+	clang_CompilationDatabase_dispose(db);
+
+	if (entries.empty()) {
+		return false;
+	}
+	for (const auto &filename : filenames) {
+		// Headers rarely have an entry of their own, use the command of
+		// the source file closest to them in the directory tree.
+		auto path = absolute_path("", filename);
+		auto dir = parent_path(path);
+		const Entry *best = &entries[0];
+		size_t best_len = 0;
+		for (const auto &entry : entries) {
+			if (entry.source == path) {
+				best = &entry;
+				break;
+			}
+			auto len = common_components(dir, parent_path(entry.source));
+			if (len > best_len) {
+				best = &entry;
+				best_len = len;
+			}
+		}
+		auto it = std::find_if(commands.begin(), commands.end(),
+		                       [best](const Command &command) {
+		                           return command.arguments == best->arguments;
+		                       });
+		if (it == commands.end()) {
+			it = commands.insert(commands.end(), {best->arguments, {}});
+		}
+		it->headers.push_back(filename);
+		headers[filename] = it - commands.begin();
+	}
+	preambles = std::make_unique<Preamble[]>(commands.size());
+	output_dir = options.output_dir.empty() ? "." : options.output_dir;
+	verbose = options.verbose;
+	return true;
+}
+
+std::vector<std::string> CompileCommands::filter_arguments(
+		CXCompileCommand command, const std::string &directory,
+		const std::string &source) {
+	// Drops the compiler, the source file and output options, and makes
+	// paths absolute since they are relative to the command's directory.
+	static constexpr std::string_view skip[] = {
+		"-c", "-M", "-MM", "-MD", "-MMD", "-MP", "--",
+	};
+	static constexpr std::string_view skip_next[] = {
+		"-o", "-MF", "-MT", "-MQ", "-x",
+	};
+	// Options taking a path as the next argument, only the ones in
+	// joined also take it in the same argument. Others such as
+	// -include-pch are passed on untouched.
+	static constexpr std::string_view paths[] = {
+		"-isystem", "-iquote", "-idirafter", "-include", "-imacros",
+		"-I", "-F",
+	};
+	static constexpr std::string_view joined[] = {
+		"-isystem", "-I", "-F",
+	};
+	std::vector<std::string> args;
+	auto count = clang_CompileCommand_getNumArgs(command);
+
+	for (unsigned i = 1; i < count; ++i) {
+		auto arg = take_string(clang_CompileCommand_getArg(command, i));
+		auto is = [&arg](std::string_view opt) { return arg == opt; };
+		if (std::any_of(std::begin(skip), std::end(skip), is)) {
+			continue;
+		}
+		if (std::any_of(std::begin(skip_next), std::end(skip_next), is)) {
+			++i;
+			continue;
+		}
+		if (arg[0] != '-' && absolute_path(directory, arg) == source) {
+			continue;
+		}
+		std::string_view option;
+		std::string value;
+		if (std::any_of(std::begin(paths), std::end(paths), is)) {
+			if (i + 1 == count) {
+				break;
+			}
+			option = arg;
+			value = take_string(clang_CompileCommand_getArg(command, ++i));
+		} else {
+			auto prefix = std::find_if(std::begin(joined), std::end(joined),
+			                           [&arg](std::string_view opt) {
+			                               return arg.size() > opt.size()
+			                                   && arg.compare(0, opt.size(),
+			                                                  opt) == 0;
+			                           });
+			if (prefix == std::end(joined)) {
+				args.push_back(arg);
+				continue;
+			}
+			option = *prefix;
+			value = arg.substr(prefix->size());
+		}
+		args.emplace_back(option);
+		args.push_back(absolute_path(directory, value));
+	}
+	return args;
+}
+
+bool CompileCommands::build_preamble(CXIndex index, const Command &command,
+                                     const std::string &path) const {
+	ProfileFile profile{path};
+	// Headers being documented can't be part of the preamble, their
+	// include guards would hide them when they are parsed themselves.
+	std::unordered_set<std::string> inputs;
+	for (const auto &header : command.headers) {
+		auto sep = header.rfind('/');
+		inputs.insert(header.substr(sep == std::string::npos ? 0 : sep + 1));
+	}
+
+	std::string text;
+	std::unordered_set<std::string> seen;
+	for (const auto &header : command.headers) {
+		MappedFile file{header};
+		std::vector<LineInfo> lines;
+		scan_lines<scan_block>(file.view(), lines);
+
+		for (const auto &line : lines) {
+			if (line.kind != LineKind::Preprocessor) {
+				continue;
+			}
+			auto directive = file.view().substr(line.offset, line.length);
+			ltrim(directive, ' ', '\t', '#');
+			if (directive.rfind("include", 0) != 0) {
+				continue;
+			}
+			directive.remove_prefix(strlen("include"));
+			ltrim(directive, ' ', '\t');
+			auto end = directive.find('>');
+			if (directive.empty() || directive[0] != '<'
+			    || end == std::string_view::npos) {
+				continue;
+			}
+			std::string name{directive.substr(1, end - 1)};
+			auto sep = name.rfind('/');
+			if (inputs.count(name.substr(sep == std::string::npos ? 0 : sep + 1))
+			    || !seen.insert(name).second) {
+				continue;
+			}
+			text += "#include <" + name + ">\n";
+		}
+	}
+	if (text.empty()) {
+		return false;
+	}
+
+	std::vector<const char *> args{"-x", "c++-header"};
+	for (const auto &arg : command.arguments) {
+		args.push_back(arg.c_str());
+	}
+	auto source = path + ".h";
+	CXUnsavedFile unsaved{source.c_str(), text.data(),
+	                      (unsigned long)text.size()};
+	TranslationUnit tu{clang_parseTranslationUnit(
+		index, source.c_str(),
+		args.data(), int(args.size()),
+		&unsaved, 1,
+		CXTranslationUnit_Incomplete | CXTranslationUnit_ForSerialization)};
+	if (tu == nullptr) {
+		return false;
+	}
+
+	// A preamble that doesn't compile would break every header using it
+	for (unsigned i = 0; i < clang_getNumDiagnostics(tu.get()); ++i) {
+		auto diag = clang_getDiagnostic(tu.get(), i);
+		auto severity = clang_getDiagnosticSeverity(diag);
+		clang_disposeDiagnostic(diag);
+		if (severity >= CXDiagnostic_Error) {
+			if (verbose) {
+				printf("%s: preamble has errors, not using it\n", path.c_str());
+			}
+			return false;
+		}
+	}
+	if (clang_saveTranslationUnit(tu.get(), path.c_str(),
+	                              clang_defaultSaveOptions(tu.get()))
+	    != CXSaveError_None) {
+		unlink(path.c_str());
+		return false;
+	}
+	if (verbose) {
+		printf("%s: %zu includes shared by %zu headers\n", path.c_str(),
+		       seen.size(), command.headers.size());
+	}
+	return true;
+}
+
+const std::vector<std::string> *CompileCommands::arguments(
+		const std::string &filename) const {
+	auto it = headers.find(filename);
+	return it == headers.end() ? nullptr : &commands[it->second].arguments;
+}
+
+const std::vector<std::string> *CompileCommands::parse_arguments(
+		CXIndex index, const std::string &filename) const {
+	auto it = headers.find(filename);
+	if (it == headers.end()) {
+		return nullptr;
+	}
+	auto i = it->second;
+	auto &preamble = preambles[i];
+	std::call_once(preamble.built, [&] {
+		preamble.arguments = commands[i].arguments;
+		auto path = output_dir + "/.pocdoc-preamble-" + std::to_string(i)
+		          + ".pch";
+		if (build_preamble(index, commands[i], path)) {
+			preamble.path = path;
+			preamble.arguments.push_back("-include-pch");
+			preamble.arguments.push_back(path);
+		}
+	});
+	return &preamble.arguments;
+}
+
+std::string output_path(const std::string &filename,
+                        const Options &options,
+                        Format format) {
+	auto out_filename = filename;
+	std::replace(out_filename.begin(), out_filename.end(), '/', '_');
+	std::replace(out_filename.begin(), out_filename.end(), '\\', '_');
+
+	if (options.trim_path_prefix != "") {
+		auto trim_pos = filename.find(options.trim_path_prefix);
+		if (trim_pos != std::string::npos) {
+			out_filename.erase(trim_pos, options.trim_path_prefix.size());
+		}
+	}
+
+	out_filename += format_extension(format);
+	if (options.output_dir != "") {
+		out_filename = options.output_dir + "/" + out_filename;
+	}
+	return out_filename;
+}
+
+std::string db_path(const std::string &filename, const Options &options,
+                    const char *extension) {
+	if (options.db_dir == "") {
+		return "";
+	}
+	auto name = filename;
+	std::replace(name.begin(), name.end(), '/', '_');
+	std::replace(name.begin(), name.end(), '\\', '_');
+	return options.db_dir + "/" + name + extension;
+}
+
+bool write_outputs(Header &header, const Options &options,
+                   FragmentCache *cache) {
+	FragmentCache stored;
+	auto stored_path = db_path(header.filename, options, ".pocfrag");
+	if (cache == nullptr && stored_path != "") {
+		stored.load(stored_path);
+		cache = &stored;
+	}
+
+	std::vector<std::unique_ptr<Renderer>> owned;
+	std::vector<Renderer *> renderers;
+	std::vector<Format> formats;
+	for (auto format : Formats) {
+		if (options.formats & format) {
+			owned.push_back(make_renderer(format, options));
+			renderers.push_back(owned.back().get());
+			formats.push_back(format);
+		}
+	}
+	if (cache != nullptr) {
+		char flags[] = {char(options.include_private), char(options.formats)};
+		cache->begin(hash_bytes(flags, sizeof(flags)));
+	}
+	header.render(renderers, cache);
+
+	bool ok = true;
+	for (size_t i = 0; i < renderers.size(); ++i) {
+		auto path = output_path(header.filename, options, formats[i]);
+		ok &= write_output(path, renderers[i]->finish());
+	}
+	if (cache == nullptr) {
+		return ok;
+	}
+	cache->end();
+	if (options.verbose) {
+		printf("%s: reused %zu of %zu sections\n", header.filename.c_str(),
+		       cache->reused, cache->reused + cache->rendered);
+	}
+	if (cache == &stored && !stored.save(stored_path) && options.verbose) {
+		printf("%s: could not write %s\n", header.filename.c_str(),
+		       stored_path.c_str());
+	}
+	return ok;
+}
+
+bool up_to_date(const Manifest *manifest, const std::string &filename,
+                const std::string &output, const Manifest::Entry &entry,
+                const Options &options) {
+	if (manifest == nullptr || !manifest->unchanged(output, entry)) {
+		return false;
+	}
+	for (auto format : Formats) {
+		struct stat pathinfo;
+		if ((options.formats & format)
+		    && stat(output_path(filename, options, format).c_str(),
+		            &pathinfo) != 0) {
+			return false;
+		}
+	}
+	if (options.verbose) {
+		printf("%s: unchanged\n", filename.c_str());
+	}
+	return true;
+}
+
+bool load_db(Header &header, const Options &options,
+             const std::vector<std::string> *arguments) {
+	auto path = db_path(header.filename, options);
+	if (path == ""
+	    || !header.load(path, parse_hash(header.filename, options, arguments))) {
+		return false;
+	}
+	if (options.verbose) {
+		printf("%s: loaded from %s\n", header.filename.c_str(), path.c_str());
+	}
+	return true;
+}
+
+void save_db(const Header &header, const Options &options,
+             const std::vector<std::string> *arguments) {
+	auto path = db_path(header.filename, options);
+	if (path == ""
+	    || header.save(path, parse_hash(header.filename, options, arguments))) {
+		return;
+	}
+	if (options.verbose) {
+		printf("%s: could not write %s\n", header.filename.c_str(),
+		       path.c_str());
+	}
+}
+
+bool build_docs(Index &index, const std::string &filename,
+                Options options, Manifest *manifest,
+                const CompileCommands *commands) {
+	ProfileFile profile{filename};
+	auto out_filename = output_path(filename, options);
+	auto source = read_source(filename);
+	auto *arguments = commands ? commands->arguments(filename) : nullptr;
+	Manifest::Entry entry{source.hash,
+	                      options_hash(filename, options, arguments)};
+
+	if (up_to_date(manifest, filename, out_filename, entry, options)) {
+		return true;
+	}
+
+	Header header{filename, std::move(source), options};
+	if (!load_db(header, options, arguments)) {
+		if (!options.fast || !header.parse_fast()) {
+			auto contents = arguments ? std::nullopt
+			                          : std::optional{header.text()};
+			auto tu = parse_translation_unit(
+				index, filename, contents, options,
+				commands ? commands->parse_arguments(index, filename)
+				         : nullptr);
+			if (tu == nullptr) {
+				if (manifest != nullptr) {
+					manifest->remove(out_filename);
+				}
+				return false;
+			}
+			// Everything needed to render the header is copied out of the
+			// AST, which is released before rendering to keep peak memory
+			// down.
+			header.parse(tu.get(), !contents);
+		}
+		save_db(header, options, arguments);
+	}
+
+	if (!write_outputs(header, options)) {
+		return false;
+	}
+	if (manifest != nullptr) {
+		manifest->update(out_filename, entry);
+	}
+	return true;
+}
+
+std::vector<std::string> build_umbrella(
+		Index &index, const std::vector<std::string> &filenames,
+		Options options, Manifest *manifest,
+		const CompileCommands *commands) {
+	struct Pending {
+		std::unique_ptr<Header> header;
+		std::string output;
+		Manifest::Entry entry;
+	};
+	struct Group {
+		const std::vector<std::string> *arguments;
+		std::vector<Pending> pending;
+	};
+	std::vector<Group> groups;
+	std::vector<std::string> failed;
+
+	auto write = [&](const Pending &p) {
+		ProfileFile profile{p.header->filename};
+		if (!write_outputs(*p.header, options)) {
+			failed.push_back(p.header->filename);
+			return;
+		}
+		if (manifest != nullptr) {
+			manifest->update(p.output, p.entry);
+		}
+	};
+
+	for (const auto &filename : filenames) {
+		ProfileFile profile{filename};
+		auto out_filename = output_path(filename, options);
+		auto source = read_source(filename);
+		auto *arguments = commands ? commands->arguments(filename) : nullptr;
+		Manifest::Entry entry{source.hash,
+		                      options_hash(filename, options, arguments)};
+
+		if (up_to_date(manifest, filename, out_filename, entry, options)) {
+			continue;
+		}
+		Pending p{std::make_unique<Header>(filename, std::move(source),
+		                                   options),
+		          out_filename, entry};
+		if (load_db(*p.header, options, arguments)) {
+			write(p);
+			continue;
+		}
+		if (options.fast && p.header->parse_fast()) {
+			save_db(*p.header, options, arguments);
+			write(p);
+			continue;
+		}
+		auto group = std::find_if(groups.begin(), groups.end(),
+		                          [arguments](const Group &g) {
+		                              return g.arguments == arguments
+		                                  || (g.arguments && arguments
+		                                      && *g.arguments == *arguments);
+		                          });
+		if (group == groups.end()) {
+			group = groups.insert(groups.end(), {arguments, {}});
+		}
+		group->pending.push_back(std::move(p));
+	}
+
+	for (auto &group : groups) {
+		std::string umbrella;
+		std::vector<Header *> headers;
+		for (const auto &p : group.pending) {
+			// Spelled as given, relative to the working directory the
+			// umbrella is parsed in. libclang names headers found this
+			// way after the umbrella's directory, so anonymous
+			// declarations in a header given as test.h are named after
+			// ./test.h instead, unlike when the header is parsed alone.
+			umbrella += "#include \"" + p.header->filename + "\"\n";
+			headers.push_back(p.header.get());
+		}
+		ProfileFile profile{"umbrella: " + headers[0]->filename + " +"
+		                    + std::to_string(headers.size() - 1)};
+		auto *arguments = commands ? commands->parse_arguments(
+			index, headers[0]->filename) : nullptr;
+		auto tu = parse_translation_unit(index, "pocdoc-umbrella.cpp",
+		                                 umbrella, options, arguments);
+		if (tu == nullptr) {
+			for (const auto &p : group.pending) {
+				failed.push_back(p.header->filename);
+				if (manifest != nullptr) {
+					manifest->remove(p.output);
+				}
+			}
+			continue;
+		}
+		Header::parse(tu.get(), headers);
+		tu.reset();
+		for (auto *header : headers) {
+			ProfileFile header_profile{header->filename};
+			save_db(*header, options, group.arguments);
+		}
+
+		for (const auto &p : group.pending) {
+			write(p);
+		}
+	}
+	return failed;
+}
+
+bool Document::update() {
+	auto source = read_source(filename);
+	if (hash == source.hash) {
+		return true;
+	}
+	hash = source.hash;
+
+	Header header{filename, std::move(source), options};
+	if (options.fast && header.parse_fast()) {
+		return write_outputs(header, options, &fragments);
+	}
+	auto contents = arguments ? std::nullopt
+	                          : std::optional{header.text()};
+	if (tu == nullptr
+	    || !reparse_translation_unit(tu, filename, contents)) {
+		tu = parse_translation_unit(
+			index, filename, contents, options,
+			commands ? commands->parse_arguments(index, filename) : nullptr);
+		if (tu == nullptr) {
+			hash.reset();
+			return false;
+		}
+	}
+	header.parse(tu.get(), !contents);
+	return write_outputs(header, options, &fragments);
+}
+
+bool build_docs(const std::string &filename, Options options) {
+	Index index;
+	return build_docs(index, filename, options);
+}
+
+Context::Context(const Options &options) : options{options} {}
+
+bool Context::render(const std::string &filename, std::string_view contents,
+                     Format format, const Sink &sink) {
+	// Names only live as long as the header, interning into a table of
+	// its own keeps a long running Context from growing with every
+	// distinct name it has seen.
+	StringTable strings;
+	StringTable::Scope scope{strings};
+	Header header{filename, make_source(contents), options};
+	if (!options.fast || !header.parse_fast()) {
+		// The translation unit is disposed before another render can
+		// take its index.
+		auto index = take_index();
+		auto tu = parse_translation_unit(*index, filename, header.text(),
+		                                 options);
+		bool parsed = tu != nullptr;
+		if (parsed) {
+			header.parse(tu.get());
+		}
+		tu.reset();
+		release_index(std::move(index));
+		if (!parsed) {
+			return false;
+		}
+	}
+
+	auto renderer = make_renderer(format, options);
+	header.render({renderer.get()});
+	const auto &output = renderer->finish();
+	for (const auto *segment : {&output.toc, &output.body}) {
+		if (!segment->empty()) {
+			sink({segment->data(), segment->size()});
+		}
+	}
+	return true;
+}
+
+std::unique_ptr<Index> Context::take_index() {
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		if (!indexes.empty()) {
+			auto index = std::move(indexes.back());
+			indexes.pop_back();
+			return index;
+		}
+	}
+	return std::make_unique<Index>();
+}
+
+void Context::release_index(std::unique_ptr<Index> index) {
+	std::lock_guard<std::mutex> lock{mutex};
+	indexes.push_back(std::move(index));
+}
+
+bool Context::render(const std::string &filename, std::string_view contents,
+                     Format format, std::string &out) {
+	out.clear();
+	return render(filename, contents, format, [&](std::string_view part) {
+		out += part;
+	});
+}
+
+} // pocdoc
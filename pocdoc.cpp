@@ -19,25 +19,137 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
 #include <cstdio>
 #include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <map>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <csignal>
+#include <unistd.h>
+#include <cerrno>
 
 #include "pocdoc.h"
 
+// Only the tool replaces the global allocator, so -memprof can count
+// allocations without affecting programs that link libpocdoc. These are
+// kept out of line, GCC warns about free on a new pointer once inlined.
+__attribute__((noinline)) void *operator new(size_t size) {
+	pocdoc::Profiler::count_allocation(size);
+	if (void *p = malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc{};
+}
+
+void *operator new[](size_t size) {
+	return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept {
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept {
+	free(p);
+}
+
 static const char *Usage =
 "pocdoc [options] cpp-files...\n\n"
 "options:\n"
 "  -o output_directory  The path to an output directory for compiled\n"
 "                       markdown files. The directory must exist.\n\n"
 "  -v                   Verbose output\n\n"
+"  -j jobs              Number of files to build in parallel. Each worker\n"
+"                       thread uses its own libclang index.\n\n"
 "  -include-private     Whether to include private member declarations.\n\n"
 "  -no-toc              This option disables creating a table of contents\n"
 "                       in the beginning of each markdown file.\n\n"
+"  -incremental         Skip headers whose contents and options have not\n"
+"                       changed since the last run, tracked in a\n"
+"                       manifest file in the output directory.\n\n"
+"  -watch               Build all files, then keep running and rebuild\n"
+"                       each header as soon as it is saved.\n\n"
+"  -raw-comments        Use the comments libclang attaches to each\n"
+"                       declaration, including /* */ block comments,\n"
+"                       instead of scanning the lines above it.\n\n"
+"  -fast                Extract declarations with a token scanner\n"
+"                       instead of parsing each header with libclang,\n"
+"                       headers the scanner can't handle are still\n"
+"                       parsed. Ignored with -raw-comments.\n\n"
+"  -umbrella            Parse the headers of each worker as a single\n"
+"                       translation unit that includes them all, so\n"
+"                       code they share is only parsed once. Headers are\n"
+"                       parsed with their includes and must be valid\n"
+"                       when included together. Ignored with -watch.\n\n"
+"  -p build_dir         Parse headers with their includes, using the\n"
+"                       flags of the closest source file listed in\n"
+"                       build_dir/compile_commands.json. Includes shared\n"
+"                       by headers with the same flags are precompiled\n"
+"                       once.\n\n"
+"  -format formats      Comma separated list of output formats to build\n"
+"                       from each parse, any of md, html and json.\n"
+"                       Defaults to md.\n\n"
+"  -db directory        Cache the declarations parsed from each header in\n"
+"                       directory, which must exist. Headers whose\n"
+"                       contents and parse options are unchanged are\n"
+"                       rendered from the cache without libclang, so\n"
+"                       only changing render options like -format or\n"
+"                       -no-toc is cheap.\n\n"
+"  -stats               Print the wall and CPU time spent reading,\n"
+"                       parsing, visiting, rendering and writing each\n"
+"                       file, with node and cursor counts.\n\n"
+"  -trace out.json      Write a Chrome trace of the same phases with one\n"
+"                       track per thread, viewable in chrome://tracing\n"
+"                       or Perfetto.\n\n"
+"  -memprof N           Count operator new calls and bytes allocated in\n"
+"                       each phase per file, record each file's peak RSS\n"
+"                       including libclang and list the N files with\n"
+"                       the highest peak. Use -j 1 for exact per-file\n"
+"                       peaks, the report has no timings so runs can\n"
+"                       be compared with diff. A libclang linked with\n"
+"                       its own C++ runtime doesn't call pocdoc's\n"
+"                       operator new, parse then only counts pocdoc's\n"
+"                       allocations and peak RSS is left to show\n"
+"                       libclang's.\n\n"
 "  -trim-path path      Trims path from the beginning of all given c++\n"
 "                       file names to use in the markdown output.\n";
 
+// Format flags from a comma separated list, 0 if any name is unknown.
+uint8_t parse_formats(const char *list) {
+    uint8_t formats = 0;
+    std::string_view names{list};
+    while (!names.empty()) {
+        auto comma = names.find(',');
+        auto name = names.substr(0, comma);
+        if (name == "md") {
+            formats |= pocdoc::FormatMarkdown;
+        } else if (name == "html") {
+            formats |= pocdoc::FormatHtml;
+        } else if (name == "json") {
+            formats |= pocdoc::FormatJson;
+        } else {
+            return 0;
+        }
+        names.remove_prefix(comma == names.npos ? names.size() : comma + 1);
+    }
+    return formats;
+}
+
 std::tuple<pocdoc::Options, std::vector<std::string>>
 parse_flags(int argc, char *argv[]) {
     pocdoc::Options opt;
@@ -53,6 +165,34 @@ parse_flags(int argc, char *argv[]) {
             opt.verbose = true;
             continue;
         }
+        if (value == "-j") {
+            opt.jobs = std::max(1, atoi(argv[++i]));
+            continue;
+        }
+        if (value == "-p") {
+            opt.compile_commands = argv[++i];
+            continue;
+        }
+        if (value == "-format") {
+            opt.formats = parse_formats(argv[++i]);
+            continue;
+        }
+        if (value == "-db") {
+            opt.db_dir = argv[++i];
+            continue;
+        }
+        if (value == "-stats") {
+            opt.stats = true;
+            continue;
+        }
+        if (value == "-trace") {
+            opt.trace_path = argv[++i];
+            continue;
+        }
+        if (value == "-memprof") {
+            opt.memprof = strtoul(argv[++i], nullptr, 10);
+            continue;
+        }
         if (value == "-trim-path") {
             opt.trim_path_prefix = argv[++i];
             continue;
@@ -61,6 +201,26 @@ parse_flags(int argc, char *argv[]) {
             opt.include_private = true;
             continue;
         }
+        if (value == "-incremental") {
+            opt.incremental = true;
+            continue;
+        }
+        if (value == "-watch") {
+            opt.watch = true;
+            continue;
+        }
+        if (value == "-raw-comments") {
+            opt.raw_comments = true;
+            continue;
+        }
+        if (value == "-fast") {
+            opt.fast = true;
+            continue;
+        }
+        if (value == "-umbrella") {
+            opt.umbrella = true;
+            continue;
+        }
         if (value == "-no-toc") {
             opt.build_toc = false;
             continue;
@@ -70,6 +230,162 @@ parse_flags(int argc, char *argv[]) {
     return {opt, tail};
 }
 
+// Work-stealing queue of input file indices. Each worker pops from the
+// front of its own deque and steals from the back of the others once it
+// runs dry, so a few very large headers don't leave the other threads idle.
+class WorkQueue {
+public:
+	WorkQueue(size_t count, size_t workers) : queues(workers) {
+		for (size_t i = 0; i < count; ++i) {
+			queues[i % workers].items.push_back(i);
+		}
+	}
+
+	bool pop(size_t worker, size_t &item) {
+		{
+			auto &own = queues[worker];
+			std::lock_guard<std::mutex> lock{own.mutex};
+			if (!own.items.empty()) {
+				item = own.items.front();
+				own.items.pop_front();
+				return true;
+			}
+		}
+		for (size_t i = 1; i < queues.size(); ++i) {
+			auto &victim = queues[(worker + i) % queues.size()];
+			std::lock_guard<std::mutex> lock{victim.mutex};
+			if (!victim.items.empty()) {
+				item = victim.items.back();
+				victim.items.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<size_t> items;
+	};
+	std::vector<Queue> queues;
+};
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interrupt(int) {
+	interrupted = 1;
+}
+
+// Builds every file once, then rebuilds headers as they are written until
+// the process is interrupted. The index and translation units stay resident
+// so an edit only costs reparsing the header that changed.
+int watch(const std::vector<std::string> &filenames,
+          const pocdoc::Options &opt,
+          const pocdoc::CompileCommands *commands) {
+	// Interrupting returns from watch instead of exiting, so preambles
+	// are removed on the way out. Without SA_RESTART the read below
+	// fails with EINTR.
+	struct sigaction action = {};
+	action.sa_handler = interrupt;
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "error: could not initialize inotify: %s\n",
+		        strerror(errno));
+		return 1;
+	}
+
+	pocdoc::Index index;
+	std::vector<std::unique_ptr<pocdoc::Document>> docs;
+	std::map<std::string, int> dirs;
+	std::map<std::pair<int, std::string>, pocdoc::Document *> watched;
+
+	for (const auto &file : filenames) {
+		auto &doc = docs.emplace_back(
+			std::make_unique<pocdoc::Document>(index, file, opt,
+			                                   commands));
+		if (!doc->update()) {
+			fprintf(stderr, "error: could not parse c++ source file: %s\n",
+			        file.c_str());
+		}
+
+		// Directories are watched instead of the files themselves since
+		// editors often save by renaming a new file over the old one.
+		auto slash = file.find_last_of('/');
+		auto dir = slash == std::string::npos ? "." : file.substr(0, slash);
+		auto base = file.substr(slash + 1);
+		if (dir == "") {
+			dir = "/";
+		}
+
+		if (dirs.find(dir) == dirs.end()) {
+			int wd = inotify_add_watch(fd, dir.c_str(),
+			                           IN_CLOSE_WRITE | IN_MOVED_TO);
+			if (wd < 0) {
+				fprintf(stderr, "error: could not watch '%s': %s\n",
+				        dir.c_str(), strerror(errno));
+				close(fd);
+				return 1;
+			}
+			dirs[dir] = wd;
+		}
+		watched[{dirs[dir], base}] = doc.get();
+	}
+	fflush(stdout);
+
+	alignas(inotify_event) char buffer[4096];
+	// An interrupt during the first builds is seen before blocking
+	while (!interrupted) {
+		auto len = read(fd, buffer, sizeof(buffer));
+		if (len < 0 && errno == EINTR && !interrupted) {
+			continue;
+		}
+		if (len <= 0) {
+			break;
+		}
+
+		// A single save usually produces several events, rebuild each
+		// document once per batch.
+		std::vector<pocdoc::Document *> changed;
+		for (char *p = buffer; p < buffer + len;) {
+			auto *event = reinterpret_cast<inotify_event *>(p);
+			p += sizeof(inotify_event) + event->len;
+			if (event->len == 0) {
+				continue;
+			}
+			auto it = watched.find({event->wd, event->name});
+			if (it == watched.end()) {
+				continue;
+			}
+			if (std::find(changed.begin(), changed.end(), it->second)
+			    == changed.end()) {
+				changed.push_back(it->second);
+			}
+		}
+
+		for (auto *doc : changed) {
+			auto start = std::chrono::steady_clock::now();
+			if (!doc->update()) {
+				fprintf(stderr, "error: could not parse c++ source file: %s\n",
+				        doc->filename.c_str());
+				continue;
+			}
+			if (opt.verbose) {
+				std::chrono::duration<double, std::milli> elapsed =
+					std::chrono::steady_clock::now() - start;
+				printf("%s: rebuilt in %.1fms\n", doc->filename.c_str(),
+				       elapsed.count());
+			}
+		}
+		fflush(stdout);
+	}
+	close(fd);
+	return interrupted ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
 	if (argc <= 1 || strcmp(argv[1], "--help") == 0) {
 		fprintf(stderr, "%s", Usage);
@@ -82,6 +398,12 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	if (opt.formats == 0) {
+		fprintf(stderr, "error: unknown output format, expected md, html "
+		        "or json\n");
+		return 1;
+	}
+
 	if (opt.output_dir != "") {
 		struct stat pathinfo;
 		if (stat(opt.output_dir.c_str(), &pathinfo) != 0) {
@@ -97,13 +419,100 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	bool error = false;
-    for (const auto &file : filenames) {
-        if (!pocdoc::build_docs(file, opt)) {
-            fprintf(stderr, "error: could not parse c++ source file: %s\n",
-				file.c_str());
-			error = true;
-        }
-    }
-	return int(error);
+
+	if (opt.stats || opt.trace_path != "" || opt.memprof > 0) {
+		auto workers = std::min(size_t(opt.jobs), filenames.size());
+		pocdoc::Profiler::global().enable(opt.trace_path != "", int(workers));
+	}
+	if (opt.memprof > 0) {
+		pocdoc::Profiler::global().enable_memory(opt.memprof);
+		// libclang parses on a thread of its own, whose allocations
+		// would be outside any phase. Parsing on the worker counts them
+		// in the parse phase of its file.
+		setenv("LIBCLANG_NOTHREADS", "1", 0);
+	}
+
+	pocdoc::CompileCommands commands;
+	if (opt.compile_commands != "") {
+		if (!commands.load(opt.compile_commands, filenames, opt)) {
+			fprintf(stderr, "error: could not load compile_commands.json "
+			        "from '%s'\n", opt.compile_commands.c_str());
+			return 1;
+		}
+	}
+	auto *commands_ptr = opt.compile_commands != "" ? &commands : nullptr;
+
+	if (opt.watch) {
+		return watch(filenames, opt, commands_ptr);
+	}
+
+	pocdoc::Manifest manifest;
+	if (opt.incremental) {
+		manifest.load(opt.output_dir);
+	}
+	auto *manifest_ptr = opt.incremental ? &manifest : nullptr;
+
+	auto workers = std::min(size_t(opt.jobs), filenames.size());
+	WorkQueue queue{filenames.size(), workers};
+	std::atomic<bool> error{false};
+
+	auto worker = [&, opt = opt](size_t id) {
+		pocdoc::Index index;
+		if (opt.umbrella) {
+			// Neighbouring headers are the most likely to include each
+			// other, each worker takes a contiguous slice.
+			auto begin = filenames.begin() + filenames.size() * id / workers;
+			auto end = filenames.begin() + filenames.size() * (id + 1) / workers;
+			auto failed = pocdoc::build_umbrella(
+				index, {begin, end}, opt, manifest_ptr, commands_ptr);
+			for (const auto &file : failed) {
+				fprintf(stderr, "error: could not parse c++ source file: %s\n",
+				        file.c_str());
+				error = true;
+			}
+			return;
+		}
+		size_t i;
+		while (queue.pop(id, i)) {
+			const auto &file = filenames[i];
+			if (!pocdoc::build_docs(index, file, opt, manifest_ptr,
+			                        commands_ptr)) {
+				fprintf(stderr, "error: could not parse c++ source file: %s\n",
+				        file.c_str());
+				error = true;
+			}
+		}
+	};
+
+	if (workers == 1) {
+		worker(0);
+	} else {
+		std::vector<std::thread> threads;
+		for (size_t id = 0; id < workers; ++id) {
+			threads.emplace_back(worker, id);
+		}
+		for (auto &thread : threads) {
+			thread.join();
+		}
+	}
+
+	if (opt.incremental && !manifest.save()) {
+		fprintf(stderr, "error: could not write manifest in '%s'\n",
+		        opt.output_dir.c_str());
+		error = true;
+	}
+
+	auto &profiler = pocdoc::Profiler::global();
+	if (opt.stats) {
+		profiler.print_stats();
+	}
+	if (opt.memprof > 0) {
+		profiler.print_memory();
+	}
+	if (opt.trace_path != "" && !profiler.write_trace(opt.trace_path)) {
+		fprintf(stderr, "error: could not write trace '%s'\n",
+		        opt.trace_path.c_str());
+		error = true;
+	}
+	return int(error.load());
 }
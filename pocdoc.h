@@ -22,175 +22,349 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <array>
+#include <deque>
+#include <string_view>
 #include <unordered_set>
+#include <unordered_map>
 #include <algorithm>
 #include <memory>
 #include <iostream>
 #include <optional>
 #include <tuple>
+#include <type_traits>
 #include <fstream>
 #include <cstdio>
 #include <cassert>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <functional>
+#include <atomic>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <utility>
 #include <clang-c/Index.h>
+#include <clang-c/CXCompilationDatabase.h>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 namespace pocdoc {
 
-bool isclass(const CXCursorKind &kind) {
-	switch (kind) {
-	case CXCursor_ClassDecl:
-	case CXCursor_ClassTemplate:
-	case CXCursor_ClassTemplatePartialSpecialization:
-		return true;
-	default:
-		return false;
-	}
-}
+// Properties of the cursor kinds pocdoc cares about, looked up in a
+// table instead of switching over the kind at every cursor.
+enum KindFlags : uint8_t {
+	KindClass     = 1 << 0,
+	KindContainer = 1 << 1,
+	KindFunc      = 1 << 2,
+	KindDecl      = 1 << 3,
+	// The visitor only descends into cursors of these kinds
+	KindScope     = 1 << 4,
+};
 
-bool iscontainer(const CXCursorKind &kind) {
-	switch (kind) {
-	case CXCursor_StructDecl:
-	case CXCursor_UnionDecl:
-	case CXCursor_ClassDecl:
-	case CXCursor_ClassTemplate:
-	case CXCursor_ClassTemplatePartialSpecialization:
-	case CXCursor_EnumDecl:
-	case CXCursor_EnumConstantDecl:
-		return true;
-	default:
-		return false;
-	}
-}
+using KindTable = std::array<uint8_t, CXCursor_LastExtraDecl + 1>;
 
-bool isfunc(const CXCursorKind &kind) {
-	switch (kind) {
-	case CXCursor_CXXMethod:
-	case CXCursor_FunctionDecl:
-	case CXCursor_FunctionTemplate:
-	case CXCursor_Constructor:
-	case CXCursor_Destructor:
-		return true;
-	default:
-		return false;
+constexpr KindTable make_kind_table() {
+	KindTable table{};
+	auto set = [&table](CXCursorKind kind, uint8_t flags) {
+		table[kind] |= flags;
+	};
+	for (auto kind : {CXCursor_ClassDecl,
+	                  CXCursor_ClassTemplate,
+	                  CXCursor_ClassTemplatePartialSpecialization}) {
+		set(kind, KindClass);
 	}
-}
-
-bool isdecl(const CXCursorKind &kind) {
-	if (iscontainer(kind) || isfunc(kind)) {
-		return true;
+	for (auto kind : {CXCursor_StructDecl,
+	                  CXCursor_UnionDecl,
+	                  CXCursor_ClassDecl,
+	                  CXCursor_ClassTemplate,
+	                  CXCursor_ClassTemplatePartialSpecialization,
+	                  CXCursor_EnumDecl}) {
+		set(kind, KindContainer | KindDecl | KindScope);
+	}
+	set(CXCursor_EnumConstantDecl, KindContainer | KindDecl);
+
+	for (auto kind : {CXCursor_CXXMethod,
+	                  CXCursor_FunctionDecl,
+	                  CXCursor_FunctionTemplate,
+	                  CXCursor_Constructor,
+	                  CXCursor_Destructor}) {
+		set(kind, KindFunc | KindDecl);
 	}
-	switch (kind) {
-	case CXCursor_FieldDecl:
-	case CXCursor_UsingDeclaration:
-	case CXCursor_TypedefDecl:
-	case CXCursor_TypeAliasDecl:
-	case CXCursor_TypeAliasTemplateDecl:
-	case CXCursor_VarDecl:
-		return true;
-	default:
-		return false;
+	for (auto kind : {CXCursor_FieldDecl,
+	                  CXCursor_UsingDeclaration,
+	                  CXCursor_TypedefDecl,
+	                  CXCursor_TypeAliasDecl,
+	                  CXCursor_TypeAliasTemplateDecl,
+	                  CXCursor_VarDecl}) {
+		set(kind, KindDecl);
 	}
+	// Declarations nested in these are still visible at namespace scope,
+	// UnexposedDecl covers constructs such as 'export' blocks and inline
+	// namespaces on some libclang versions.
+	for (auto kind : {CXCursor_Namespace,
+	                  CXCursor_LinkageSpec,
+	                  CXCursor_UnexposedDecl,
+	                  CXCursor_FriendDecl}) {
+		set(kind, KindScope);
+	}
+	// May define a type inline, 'typedef struct { ... } T;' only
+	// reaches the struct through the typedef.
+	for (auto kind : {CXCursor_TypedefDecl,
+	                  CXCursor_TypeAliasDecl,
+	                  CXCursor_VarDecl,
+	                  CXCursor_FieldDecl}) {
+		set(kind, KindScope);
+	}
+	return table;
 }
 
-const char *decl_str(const CXCursorKind &kind) {
-	switch (kind) {
-	case CXCursor_StructDecl:  return "Struct";
-	case CXCursor_UnionDecl:   return "Union";
-	case CXCursor_EnumDecl:    return "Enum";
-
-	case CXCursor_EnumConstantDecl:
-		return "Enum Constant";
+constexpr KindTable kind_table = make_kind_table();
 
-	case CXCursor_ClassDecl:
-	case CXCursor_ClassTemplate:
-		return "Class";
+constexpr uint8_t kind_flags(CXCursorKind kind) {
+	return unsigned(kind) < kind_table.size() ? kind_table[kind] : 0;
+}
 
-	case CXCursor_CXXMethod:
-	case CXCursor_FunctionDecl:
-	case CXCursor_FunctionTemplate:
-		return "Function";
+constexpr bool isclass(CXCursorKind kind) {
+	return kind_flags(kind) & KindClass;
+}
 
-	case CXCursor_Constructor:      return "Constructor";
-	case CXCursor_Destructor:       return "Destructor";
-	case CXCursor_UsingDeclaration: return "Using";
-	case CXCursor_TypedefDecl:      return "Typedef";
+constexpr bool iscontainer(CXCursorKind kind) {
+	return kind_flags(kind) & KindContainer;
+}
 
-	case CXCursor_TypeAliasDecl:
-	case CXCursor_TypeAliasTemplateDecl:
-		return "Type Alias";
+constexpr bool isfunc(CXCursorKind kind) {
+	return kind_flags(kind) & KindFunc;
+}
 
-	case CXCursor_VarDecl:    return "Variable";
-	case CXCursor_FieldDecl:  return "Field";
+constexpr bool isdecl(CXCursorKind kind) {
+	return kind_flags(kind) & KindDecl;
+}
 
-	default:
-		// Kind should not be printed
-		return nullptr;
-	}
+constexpr bool isscope(CXCursorKind kind) {
+	return kind_flags(kind) & KindScope;
 }
 
-std::string get_qualified_name(const CXCursor &cursor) {
-	auto kind = clang_getCursorKind(cursor);
-	if (kind == CXCursor_TranslationUnit || kind == CXCursor_FirstInvalid) {
-		return "";
-	}
-	auto spelling = clang_getCursorSpelling(cursor);
-	std::string name(clang_getCString(spelling));
-	clang_disposeString(spelling);
+const char *decl_str(const CXCursorKind &kind);
 
-	auto res = get_qualified_name(clang_getCursorSemanticParent(cursor));
-	if (res == "") {
-		return name;
-	}
-	return res + "::" + name;
-}
+std::string take_string(CXString str);
+
+// Absolute, normalized path of an existing file, or path joined to
+// directory if it doesn't exist.
+std::string absolute_path(const std::string &directory,
+                          const std::string &path);
+
+std::string parent_path(const std::string &path);
+
+std::string get_qualified_name(const CXCursor &cursor);
 
 template<typename... Args>
-void ltrim(std::string &str, int count, Args... ch) {
+void ltrim(std::string_view &str, int count, Args... ch) {
 	if (count == -1) {
 		count = str.size() + 1;
 	}
-	str.erase(str.begin(), std::find_if(str.begin(), str.end(),
+	auto it = std::find_if(str.begin(), str.end(),
 		[ch..., &count](char c) {
 			bool match = ((c == ch) || ...);
 			if (match) --count;
 			return (!match) || count < 0;
-		}));
+		});
+	str.remove_prefix(it - str.begin());
 }
 
 template<typename... Args>
-void ltrim(std::string &str, Args... ch) {
+void ltrim(std::string_view &str, Args... ch) {
 	ltrim(str, -1, ch...);
 }
 
 template<typename... Args>
-void rtrim(std::string &str, int count, Args... ch) {
+void rtrim(std::string_view &str, int count, Args... ch) {
 	if (count == -1) {
 		count = str.size() + 1;
 	}
-	str.erase(std::find_if(str.rbegin(), str.rend(),
+	auto it = std::find_if(str.rbegin(), str.rend(),
 		[ch..., &count](char c) {
 			bool match = ((c == ch) || ...);
 			if (match) --count;
 			return (!match) || count < 0;
-		}).base(), str.end());
+		});
+	str.remove_suffix(it - str.rbegin());
 }
 
 template<typename... Args>
-void rtrim(std::string &str, Args... ch) {
+void rtrim(std::string_view &str, Args... ch) {
 	rtrim(str, -1, ch...);
 }
 
+// Handle to a string interned in a StringTable, valid while the table
+// is. Equal strings share one handle, so names compare equal by
+// pointer. Ordering compares the characters.
+class Name {
+public:
+	Name() : value{&empty_string()} {}
+
+	const std::string &str() const { return *value; }
+	const char *c_str() const { return value->c_str(); }
+	bool empty() const { return value->empty(); }
+
+	bool operator==(Name other) const { return value == other.value; }
+	bool operator!=(Name other) const { return value != other.value; }
+	bool operator<(Name other) const { return *value < *other.value; }
+
+	struct Hash {
+		size_t operator()(Name name) const {
+			return std::hash<const void *>{}(name.value);
+		}
+	};
+
+private:
+	friend class StringTable;
+
+	explicit Name(const std::string *value) : value{value} {}
+
+	static const std::string &empty_string() {
+		static const std::string str;
+		return str;
+	}
+
+	const std::string *value;
+};
+
+// Interned strings shared by every header built in a run. Strings are
+// only freed with the table, the global one lives as long as the
+// process. Lookups are sharded by hash so concurrent workers rarely
+// wait on the same lock.
+class StringTable {
+public:
+	static StringTable &global() {
+		static StringTable table;
+		return table;
+	}
+
+	// Table intern uses on this thread, the global one outside a Scope
+	static StringTable &current() {
+		return scoped ? *scoped : global();
+	}
+
+	// Interns into table on this thread while alive. Names interned in
+	// the scope must not outlive the table.
+	class Scope {
+	public:
+		explicit Scope(StringTable &table) : previous{scoped} {
+			scoped = &table;
+		}
+		~Scope() { scoped = previous; }
+
+		Scope(const Scope &) = delete;
+		Scope &operator=(const Scope &) = delete;
+
+	private:
+		StringTable *previous;
+	};
+
+	Name intern(std::string_view str);
+
+private:
+	static inline thread_local StringTable *scoped = nullptr;
+
+	static constexpr size_t ShardCount = 16;
+
+	struct Shard {
+		std::mutex mutex;
+		// Deque elements don't move, the map keys point into them
+		std::deque<std::string> storage;
+		std::unordered_map<std::string_view, const std::string *> strings;
+	};
+
+	std::array<Shard, ShardCount> shards;
+};
+
+Name intern(std::string_view str);
+
+using QualifiedName = Name;
+
+// Owning handle to a libclang index, one is shared by every file
+// built on the same thread. The index is only created once a file is
+// parsed, runs where every file is up to date or cached don't pay for it.
+class Index {
+public:
+	Index() = default;
+	~Index() {
+		if (index != nullptr) {
+			clang_disposeIndex(index);
+		}
+	}
+
+	Index(const Index &) = delete;
+	Index &operator=(const Index &) = delete;
+
+	operator CXIndex() {
+		if (index == nullptr) {
+			index = clang_createIndex(0, 0);
+		}
+		return index;
+	}
+
+private:
+	CXIndex index = nullptr;
+};
+
+struct TranslationUnitDeleter {
+	void operator()(CXTranslationUnit tu) const {
+		clang_disposeTranslationUnit(tu);
+	}
+};
+
+using TranslationUnit =
+	std::unique_ptr<std::remove_pointer_t<CXTranslationUnit>,
+	                TranslationUnitDeleter>;
+
+// Qualified names of the cursors visited in one translation unit. Each
+// name is built once, from the cached name of its semantic parent.
+class QualifiedNameCache {
+public:
+	QualifiedName get(const CXCursor &cursor);
+
+private:
+	struct CursorHash {
+		size_t operator()(const CXCursor &cursor) const {
+			return clang_hashCursor(cursor);
+		}
+	};
+
+	struct CursorEqual {
+		bool operator()(const CXCursor &lhs, const CXCursor &rhs) const {
+			return clang_equalCursors(lhs, rhs) != 0;
+		}
+	};
+
+	std::unordered_map<CXCursor, QualifiedName,
+	                   CursorHash, CursorEqual> names;
+	std::string scratch;
+};
+
 struct SourceRange {
-	unsigned line_start, line_end;
+	unsigned line_start = 0, line_end = 0;
 };
 
-struct Node;
+// Index of a node in its Header's node store.
+using NodeId = uint32_t;
 
-using QualifiedName = std::string;
-using NodeMap = std::map<QualifiedName, std::unique_ptr<Node>>;
+constexpr NodeId RootNode = 0;
+constexpr NodeId RemovedNode = ~NodeId{0};
 
 struct Node {
-	std::string name;
-	std::string qualified_name;
+	Name name;
+	QualifiedName qualified_name;
 
 	CXCursorKind kind;
 	CX_CXXAccessSpecifier access;
@@ -198,11 +372,16 @@ struct Node {
 	SourceRange decl_range;
 	std::optional<SourceRange> doc_range;
 
-	NodeMap children;
+	NodeId parent = RootNode;
+
+	// Range of the Header's child lists holding this node's children,
+	// set once the whole header has been parsed.
+	uint32_t children_begin = 0;
+	uint32_t children_end = 0;
 
 	Node() = default;
 
-	Node(const std::string &name, const std::string &qname,
+	Node(Name name, QualifiedName qname,
 	     CXCursorKind kind, CX_CXXAccessSpecifier access,
 	     SourceRange decl_range, std::optional<SourceRange> doc_range)
 		: name{name}
@@ -211,505 +390,887 @@ struct Node {
 		, access{access}
 		, decl_range{decl_range}
 		, doc_range{doc_range} {}
+
+	size_t child_count() const { return children_end - children_begin; }
 };
 
-struct Options {
-	bool include_private = false;
-	bool build_toc = true;
-	bool verbose = false;
-	std::string output_dir;
-	std::string trim_path_prefix;
+// A contiguous run of node ids, as stored in the Header's child lists.
+struct NodeList {
+	const NodeId *first;
+	const NodeId *last;
+
+	const NodeId *begin() const { return first; }
+	const NodeId *end() const { return last; }
 };
 
-class Header {
+// Growable contiguous byte buffer that output is formatted into directly,
+// without per-line allocations or a fixed size limit.
+class Buffer {
 public:
-	std::string filename;
-
-	Header(const std::string &filename,
-	       std::vector<std::string> &&lines, Options opt)
-		: filename{filename}, lines{std::move(lines)}, options{opt} {}
+	Buffer() = default;
+	Buffer(Buffer &&other) noexcept { *this = std::move(other); }
+
+	Buffer &operator=(Buffer &&other) noexcept {
+		bytes = std::move(other.bytes);
+		length = std::exchange(other.length, 0);
+		capacity = std::exchange(other.capacity, 0);
+		last = std::exchange(other.last, 0);
+		return *this;
+	}
 
-	void parse(CXTranslationUnit tu);
+	template<typename... Args>
+	void append(const char *fmt, Args... args);
+	void append(std::string_view str);
+	void append(const char *str) { append(std::string_view{str}); }
 
-	const std::vector<std::string> &build();
+	const char *data() const { return bytes.get(); }
+	size_t size() const { return length; }
+	bool empty() const { return length == 0; }
+	char operator[](size_t i) const { return bytes[i]; }
 
-	void insert(const CXCursor &cursor, std::unique_ptr<Node> node);
-	std::unique_ptr<Node> *find(NodeMap &declmap,
-	                            const QualifiedName &name) const;
+	// Offset where the most recent append started.
+	size_t last_append() const { return last; }
 
-	std::string parse_source(unsigned start, unsigned end, int indent) const;
-	std::string parse_comment(const SourceRange &range) const;
+	void truncate(size_t size) { length = std::min(size, length); }
+	void pop_back() { truncate(length - 1); }
+	void clear() { length = last = 0; }
 
 private:
-	std::optional<SourceRange> find_doc(unsigned linenum) const;
+	void reserve(size_t size);
 
-	void append_child_nodes(const std::unique_ptr<Node> &parent, int indent);
+	std::unique_ptr<char[]> bytes;
+	size_t length = 0;
+	size_t capacity = 0;
+	size_t last = 0;
+};
 
-	void append_decl(const char *pre, const char *kind,
-	                 const std::unique_ptr<Node> &node);
+template<typename... Args>
+void Buffer::append(const char *fmt, Args... args) {
+	// Format straight into the spare capacity, growing and formatting
+	// again only when the result doesn't fit.
+	reserve(length + 256);
+	auto n = snprintf(bytes.get() + length, capacity - length, fmt, args...);
+	if (n < 0) {
+		return;
+	}
+	if (size_t(n) >= capacity - length) {
+		reserve(length + n + 1);
+		snprintf(bytes.get() + length, capacity - length, fmt, args...);
+	}
+	last = length;
+	length += n;
+}
 
-	void append_fields(const std::unique_ptr<Node> &parent);
+// Rendered output of a header. The table of contents is only known
+// once the body has been built, so it is kept as its own segment and
+// written in front of the body instead of being spliced into it.
+struct Output {
+	Buffer toc;
+	Buffer body;
 
-	void build(NodeMap &declmap, int depth);
+	size_t size() const { return toc.size() + body.size(); }
+};
 
-	void build_toc(std::vector<std::string> &toc,
-	               NodeMap &declmap, int depth) const;
+// Stages of building a header, timed separately by -stats and -trace.
+enum Phase : uint8_t {
+	PhaseRead,   // Reading and stripping the header
+	PhaseParse,  // libclang parsing the translation unit
+	PhaseVisit,  // Building the node tree
+	PhaseRender,
+	PhaseWrite,
+	PhaseCount,
+};
 
-	template<typename... Args>
-	void append(const char *fmt, Args... args);
-	void append(const char *s);
+const char *phase_str(Phase phase);
 
-	std::vector<std::string> compiled;
-	std::vector<std::string> lines;
-	NodeMap declarations;
-	Options options;
+uint64_t clock_ns(clockid_t clock);
+
+// Wall and CPU time of each phase, attributed to the file the calling
+// thread is working on. Disabled unless -stats or -trace is given, in
+// which case every phase takes a lock once when it ends.
+class Profiler {
+public:
+	static Profiler &global() {
+		static Profiler profiler;
+		return profiler;
+	}
+
+	// libclang parses on threads of its own, so CPU time is only
+	// complete when measured for the whole process with one worker.
+	void enable(bool trace, int workers);
+	bool enabled() const { return active; }
+
+	// Counts allocations per phase and records the peak RSS of each
+	// file once enabled, print_memory lists the worst files. Peaks are
+	// for the whole process, so they are only per file with one worker.
+	void enable_memory(size_t worst);
+
+	// Called by the operator new replacement of the pocdoc tool for
+	// every allocation. Counts are kept per thread, the hook never
+	// takes a lock. libclang is only counted when it calls the tool's
+	// operator new, not when it brings its own C++ runtime.
+	static void count_allocation(size_t size);
+
+	// Per-file statistics, sorted by filename, then totals.
+	void print_stats() const;
+
+	// Allocations per file and phase, then the files with the highest
+	// peak RSS. Only counts and sizes are printed, no timings, so runs
+	// can be compared with diff.
+	void print_memory() const;
+
+	// Chrome trace event format, one track per thread.
+	bool write_trace(const std::string &path) const;
+
+private:
+	friend class ProfileFile;
+	friend class PhaseTimer;
+
+	struct FileStats {
+		std::string name;
+		uint64_t wall[PhaseCount] = {};
+		uint64_t cpu[PhaseCount] = {};
+		size_t nodes = 0;
+		size_t cursors = 0;
+		uint64_t allocations[PhaseCount] = {};
+		uint64_t allocated[PhaseCount] = {};
+		size_t peak_rss = 0; // kB
+	};
+
+	// Allocations made by one thread, indexed by phase. Allocations
+	// outside of any phase are counted in the unattributed totals
+	// instead. Zeroed as a thread_local.
+	struct AllocationCounts {
+		uint64_t count[PhaseCount];
+		uint64_t bytes[PhaseCount];
+	};
+
+	struct Event {
+		Phase phase;
+		uint32_t thread;
+		uint32_t file;
+		uint64_t start;
+		uint64_t duration;
+	};
+
+	static constexpr uint32_t NoFile = ~uint32_t{0};
+
+	uint32_t thread_id();
+	uint32_t begin_file(const std::string &name);
+	void record(Phase phase, uint64_t start, uint64_t wall, uint64_t cpu,
+	            uint64_t allocations, uint64_t allocated);
+	void count(size_t nodes, size_t cursors);
+	void reset_peak_rss();
+	void record_peak_rss();
+
+	bool active = false;
+	bool tracing = false;
+	size_t worst_files = 0;
+	static inline bool counting = false;
+	static inline std::atomic<uint64_t> unattributed_count{0};
+	static inline std::atomic<uint64_t> unattributed_bytes{0};
+	clockid_t cpu_clock = CLOCK_THREAD_CPUTIME_ID;
+	uint64_t epoch = 0;
+
+	mutable std::mutex mutex;
+	std::vector<FileStats> files;
+	std::unordered_map<std::string, uint32_t> file_index;
+	std::vector<Event> events;
+	uint32_t threads = 0;
+
+	static inline thread_local uint32_t current_file = NoFile;
+	static inline thread_local uint32_t current_thread = NoFile;
+	static inline thread_local Phase current_phase = PhaseCount;
+	static inline thread_local AllocationCounts allocations;
 };
 
-template<typename... Args>
-void Header::append(const char *fmt, Args... args) {
-	char sbuf[512];
-	snprintf(sbuf, sizeof(sbuf)-1, fmt, args...);
-	sbuf[sizeof(sbuf)-1] = 0;
-	compiled.emplace_back(std::string{sbuf});
-}
+// Attributes the phases timed by the calling thread to a file for as
+// long as it is alive.
+class ProfileFile {
+public:
+	explicit ProfileFile(const std::string &name);
+	~ProfileFile();
 
-void Header::append(const char *s) {
-	compiled.emplace_back(s);
-}
+	ProfileFile(const ProfileFile &) = delete;
+	ProfileFile &operator=(const ProfileFile &) = delete;
 
-std::unique_ptr<Node> *Header::find(NodeMap &map,
-                                    const QualifiedName &name) const {
-	if (map.find(name) != map.end()) {
-		return &map[name];
-	}
-	for (auto &kv : map) {
-		auto &parent = kv.second;
-		auto *node = find(parent->children, name);
-		if (node != nullptr) {
-			return node;
-		}
-	}
-	return nullptr;
-}
+	// Adds node and cursor counts to the calling thread's current file.
+	static void count(size_t nodes, size_t cursors);
 
-void Header::insert(const CXCursor &cursor, std::unique_ptr<Node> node) {
-	if (declarations.find(node->qualified_name) != declarations.end()) {
-		// Duplicare declaration, bias the documented declaration,
-		// if neither node is documented, bias the most recent declaration
-		auto &current = declarations[node->qualified_name];
-		if (current->doc_range) {
-			return;
-		}
-		declarations[node->qualified_name] = std::move(node);
-		return;
-	}
-	auto parent = clang_getCursorSemanticParent(cursor);
-	if (isfunc(clang_getCursorKind(parent))) {
-		// Prevents variables declared inside functions to be added
-		return;
-	}
-	if (iscontainer(clang_getCursorKind(parent))) {
-		auto parent_name = get_qualified_name(parent);
-		auto &parent_node = *find(declarations, parent_name);
-		parent_node->children.insert({node->qualified_name, std::move(node)});
-		return;
-	}
-	declarations.insert({node->qualified_name, std::move(node)});
-}
+private:
+	uint32_t previous;
+	// Files open on this thread. Only the outermost resets the peak RSS,
+	// files nested in it are charged the peak of the whole scope, such
+	// as each header of an umbrella parse.
+	static inline thread_local int depth = 0;
+};
 
-void Header::parse(CXTranslationUnit tu) {
-	auto tu_cursor = clang_getTranslationUnitCursor(tu);
-	clang_visitChildren(tu_cursor, [](auto cursor, auto, auto cdata) {
-		auto self = reinterpret_cast<Header *>(cdata);
-		auto loc = clang_getCursorLocation(cursor);
+// Times a phase from construction to destruction.
+class PhaseTimer {
+public:
+	explicit PhaseTimer(Phase phase);
+	~PhaseTimer();
 
-		if (clang_Location_isFromMainFile(loc) == 0) {
-			return CXChildVisit_Continue;
-		}
-		auto kind = clang_getCursorKind(cursor);
+	PhaseTimer(const PhaseTimer &) = delete;
+	PhaseTimer &operator=(const PhaseTimer &) = delete;
 
-		if (!clang_isDeclaration(kind) || !isdecl(kind)) {
-			return CXChildVisit_Recurse;
-		}
+private:
+	Phase phase;
+	Phase previous;
+	uint64_t wall = 0;
+	uint64_t cpu = 0;
+	uint64_t allocations = 0;
+	uint64_t allocated = 0;
+};
+
+// Output formats, any combination can be rendered from one parse.
+enum Format : uint8_t {
+	FormatMarkdown = 1 << 0,
+	FormatHtml     = 1 << 1,
+	FormatJson     = 1 << 2,
+};
 
-		auto access = clang_getCXXAccessSpecifier(cursor);
-		auto src_range = clang_getCursorExtent(cursor);
-		auto loc_start = clang_getRangeStart(src_range);
-		auto loc_end = clang_getRangeEnd(src_range);
+constexpr Format Formats[] = {FormatMarkdown, FormatHtml, FormatJson};
 
-		unsigned line_start, line_end;
-		clang_getSpellingLocation(loc_start, nullptr,
-		                          &line_start, nullptr, nullptr);
+const char *format_extension(Format format);
 
-		clang_getSpellingLocation(loc_end, nullptr,
-		                          &line_end, nullptr, nullptr);
+struct Options {
+	bool include_private = false;
+	bool build_toc = true;
+	bool verbose = false;
+	bool incremental = false;
+	bool watch = false;
+	bool raw_comments = false;
+	bool fast = false;
+	// Parse all headers given to a worker as one translation unit that
+	// includes them, instead of one translation unit per header.
+	bool umbrella = false;
+	uint8_t formats = FormatMarkdown;
+	int jobs = 1;
+	// Directory of declaration databases, headers whose contents and
+	// parse options are unchanged are rendered from it without parsing.
+	std::string db_dir;
+	// Profiling output, see Profiler
+	bool stats = false;
+	std::string trace_path;
+	// Files with the highest peak RSS to list, 0 to not profile memory
+	size_t memprof = 0;
+	// Build directory with a compile_commands.json, headers are parsed
+	// with their includes and the flags it lists when set.
+	std::string compile_commands;
+	std::string output_dir;
+	std::string trim_path_prefix;
+};
 
-		auto name = clang_getCursorSpelling(cursor);
-		auto qname = get_qualified_name(cursor);
+enum class LineKind : uint8_t {
+	Code,
+	Comment,      // First non blank characters are '//'
+	Preprocessor, // First non blank character is '#'
+};
 
-		if (self->options.verbose) {
-			printf("%s [%d-%d]: %s %s\n", self->filename.c_str(),
-			                              line_start, line_end,
-			                              decl_str(kind),
-			                              qname.c_str());
-		}
+struct LineInfo {
+	size_t offset;
+	size_t length;
+	LineKind kind;
+};
 
-		std::string name_str{clang_getCString(name)};
+// Newline and blank (space or tab) positions in a 64 byte block.
+struct BlockMasks {
+	uint64_t newline;
+	uint64_t blank;
+};
 
-		SourceRange decl_range{line_start, line_end};
-		auto doc_range = self->find_doc(line_start);
-		auto node = std::make_unique<Node>(name_str, qname, kind, access,
-		                                   decl_range, doc_range);
+BlockMasks scan_block_scalar(const char *p);
 
-		self->insert(cursor, std::move(node));
-		clang_disposeString(name);
-		return CXChildVisit_Recurse;
-	}, this);
-}
+// Scans with AVX2 or SSE2 when the target has them, otherwise the
+// same as scan_block_scalar.
+BlockMasks scan_block(const char *p);
 
-std::optional<SourceRange> Header::find_doc(unsigned linenum) const {
-	if (--linenum < 0 || linenum >= lines.size()) {
-		return {};
-	}
-	std::string line;
-	unsigned start;
-	unsigned end = linenum;
-	bool found_comment = false;
-
-	for (int repeat = 0; linenum >= 0 && repeat < 2; --linenum) {
-		line = lines[linenum];
-		ltrim(line, ' ', '\t');
-		if (line.rfind("//", 0) != 0) {
-			if (found_comment) {
-				start = linenum + 1;
+// Splits text into lines and classifies each one by its first non blank
+// characters in a single sweep, 64 bytes at a time. Line lengths exclude
+// the newline, a last line without one is still included.
+template<BlockMasks (*ScanBlock)(const char *)>
+void scan_lines(std::string_view text, std::vector<LineInfo> &lines) {
+	auto classify = [&](size_t first) {
+		if (text[first] == '#') {
+			return LineKind::Preprocessor;
+		}
+		if (text[first] == '/' && first + 1 < text.size()
+		    && text[first + 1] == '/') {
+			return LineKind::Comment;
+		}
+		return LineKind::Code;
+	};
+
+	size_t line_start = 0;
+	auto kind = LineKind::Code;
+	bool searching = true; // Looking for the first non blank character
+
+	for (size_t base = 0; base < text.size(); base += 64) {
+		auto remaining = text.size() - base;
+		BlockMasks masks;
+		if (remaining >= 64) {
+			masks = ScanBlock(text.data() + base);
+		} else {
+			char tail[64] = {};
+			memcpy(tail, text.data() + base, remaining);
+			masks = ScanBlock(tail);
+		}
+		uint64_t valid = remaining >= 64 ? ~uint64_t{0}
+		                                 : (uint64_t{1} << remaining) - 1;
+		uint64_t newline = masks.newline & valid;
+		uint64_t nonblank = ~masks.blank & valid;
+		uint64_t ahead = valid; // Bits at or after the current position
+
+		for (;;) {
+			auto candidates = (searching ? nonblank : newline) & ahead;
+			if (candidates == 0) {
 				break;
 			}
-			--end;
-			++repeat;
-			continue;
+			int i = __builtin_ctzll(candidates);
+			if (searching && ((newline >> i) & 1) == 0) {
+				kind = classify(base + i);
+				searching = false;
+				ahead &= ~uint64_t{0} << i;
+				continue;
+			}
+			lines.push_back({line_start, base + i - line_start, kind});
+			line_start = base + i + 1;
+			kind = LineKind::Code;
+			searching = true;
+			ahead = i == 63 ? 0 : ahead & (~uint64_t{0} << (i + 1));
 		}
-		found_comment = true;
 	}
-
-	if (!found_comment) {
-		return {};
+	if (line_start < text.size()) {
+		lines.push_back({line_start, text.size() - line_start, kind});
 	}
-	return SourceRange{start, end};
 }
 
-std::string Header::parse_source(unsigned start, unsigned end,
-                                 int indent) const {
-	assert(start < lines.size() && end < lines.size());
-	std::string indent_str(indent, ' ');
-	std::string result;
-
-	for (unsigned i = (start - 1); i < end; ++i) {
-		auto line = lines[i];
-		ltrim(line, '\t');
-		rtrim(line, ';');
-
-		if (line.rfind('{') != std::string::npos) {
-			// The end position is the true ending of the declaration
-			// including the funciton body if it has any. We only want
-			// the declaration signature so we stop early if an opening
-			// brace is reached.
-			rtrim(line, '{', ' ');
-			result += indent_str + line;
-			break;
-		}
+// Header contents with preprocessor lines removed. The stripped text is
+// handed to libclang as an unsaved file, and lines are views into it.
+struct Source {
+	static constexpr uint32_t NoComment = ~uint32_t{0};
 
-		result += indent_str + line;
-		if (i < (end - 1)) {
-			result.push_back('\n');
-		}
+	std::vector<char> contents;
+	std::vector<std::string_view> lines;
+
+	// For each comment line, the first line of the block of comment
+	// lines it belongs to, NoComment for any other line.
+	std::vector<uint32_t> comment_start;
+
+	// 1 based line in contents for each line of the file on disk, which
+	// is what libclang reports when a header is parsed with its includes.
+	// Preprocessor lines map to the line following them.
+	std::vector<uint32_t> line_map;
+
+	uint64_t hash = 0;
+
+	std::string_view text() const {
+		return {contents.data(), contents.size()};
 	}
-	return result;
-}
+};
 
-std::string Header::parse_comment(const SourceRange &range) const {
-	std::string line;
+// A declaration handed to renderers. Code is the declaration's source,
+// for containers followed by the source of their members.
+struct RenderDecl {
+	const Node &node;
+	const char *kind;
+	int depth;
+	bool container;
+	std::string_view code;
+	std::string_view comment;
+};
+
+// A documented member variable of a container.
+struct RenderField {
+	Name name;
 	std::string comment;
+};
 
-	for (unsigned ln = range.line_start; ln <= range.line_end; ++ln) {
-		line = lines[ln];
-		ltrim(line, ' ','\t');
-		ltrim(line, 3, '/');
-		ltrim(line, 1, ' ');
-		if (line.empty()) {
-			comment.push_back('\n');
-			comment.push_back('\n');
-			continue;
-		}
-		if (ln < range.line_end) {
-			line.push_back(' ');
-		}
-		comment += line;
-	}
-	return comment;
-}
+// Turns a parsed header into one output format. The header walks its
+// declarations once and hands each one to every renderer, so any number
+// of formats cost a single parse and a single walk.
+class Renderer {
+public:
+	virtual ~Renderer() = default;
 
-void Header::append_child_nodes(const std::unique_ptr<Node> &parent,
-                                int indent) {
-	// Nodes are sorted so they appear in the same order as they
-	// were declared in the source. Only when displaying the source
-	// of classes, structs, unions and enums.
-	std::vector<Node *> sorted_nodes;
-	for (const auto &kv : parent->children) {
-		const auto &node = kv.second;
-		sorted_nodes.push_back(node.get());
-	}
-	std::sort(sorted_nodes.begin(), sorted_nodes.end(),
-		[](const Node *lhs, const Node *rhs) {
-			return lhs->decl_range.line_start < rhs->decl_range.line_start;
-		});
+	virtual void begin(const std::string &filename) = 0;
 
-	std::unordered_set<unsigned> parsed_decl;
-	auto access = CX_CXXInvalidAccessSpecifier;
+	// Table of contents entry, only called when it is enabled. Entries
+	// come after all declarations.
+	virtual void toc_entry(const Node &node, const char *kind,
+	                       int depth) = 0;
 
-	for (size_t i = 0; i < sorted_nodes.size(); ++i) {
-		const auto *node = sorted_nodes[i];
-		auto [line_start, line_end] = node->decl_range;
+	// Declarations of a container come between its begin_decl and
+	// end_decl, after its fields. The code and comment of the decl are
+	// only valid in begin_decl.
+	virtual void begin_decl(const RenderDecl &decl,
+	                        const std::vector<RenderField> &fields) = 0;
+	virtual void end_decl(const RenderDecl &decl) = 0;
 
-		if (!options.include_private && node->access == CX_CXXPrivate) {
-			continue;
-		}
+	// Called before each top level declaration, whether it is rendered
+	// or replayed from a FragmentCache. Anything written here is not
+	// part of the cached section.
+	virtual void begin_section() {}
 
-		// Avoid duplicating lines that include multiple declarations
-		// as to not output 'float x, y;' twice for example.
-		if (parsed_decl.find(line_start) != parsed_decl.end()) {
-			continue;
-		}
-		parsed_decl.insert(line_start);
-		auto formatted = parse_source(line_start, line_end, indent);
-
-		auto semi = node->kind == CXCursor_EnumConstantDecl
-		          ? "" : ";";
-		auto lf = node->kind == CXCursor_EnumConstantDecl
-		          ? "" : "\n";
-
-		if (node->access != access) {
-			// public is default for structs so it is not included
-			if (node->access == CX_CXXPublic && isclass(parent->kind)) {
-				append("public:\n");
-			} else if (node->access == CX_CXXProtected) {
-				append("protected:\n");
-			} else if (node->access == CX_CXXPrivate) {
-				append("private:\n");
-			}
-			access = node->access;
-		}
+	// Whether output depends on line numbers, sections of such renderers
+	// aren't reused once they moved.
+	virtual bool uses_lines() const { return false; }
 
-		append("%s%s%s\n", formatted.c_str(), semi, lf);
-	}
-	if (compiled.size() == 0) {
-		// Really should not happen
-		return;
-	}
-	auto &last = compiled.back();
-	if (last.size() > 1 && last[last.size() - 2] == '\n') {
-		// Remove extra line ending
-		last.pop_back();
-	}
-}
+	virtual const Output &finish() = 0;
 
-void Header::append_decl(const char *pre, const char *kind,
-                         const std::unique_ptr<Node> &node) {
-	auto [line_start, line_end] = node->decl_range;
-	auto formatted = parse_source(line_start, line_end, 0);
+	// Top level sections are written to the body, which is where cached
+	// sections are copied from and replayed into.
+	Buffer &body() { return output.body; }
 
-	auto semi = node->kind == CXCursor_EnumConstantDecl
-	          ? "" : ";";
+protected:
+	Output output;
+};
 
-	append("%s %s `%s`\n\n", pre, kind, node->qualified_name.c_str());
-	append("```cpp\n");
-	append("%s%s\n", formatted.c_str(), semi);
-	append("```\n");
-}
+std::unique_ptr<Renderer> make_renderer(Format format,
+                                        const Options &options);
 
-void Header::append_fields(const std::unique_ptr<Node> &parent) {
-	bool has_fields = false;
-	append("#### Member Variables\n");
+// Rendered top level sections of a header from its previous render.
+// Sections whose declarations, source and comments are unchanged are
+// copied from here instead of being rendered again, so rendering after
+// an edit costs about as much as the sections the edit touched.
+class FragmentCache {
+public:
+	struct Fragment {
+		uint64_t content_hash = 0;
+		uint64_t line_hash = 0;
+		// Section bytes written by each renderer, in renderer order
+		std::vector<std::string> outputs;
+	};
 
-	for (const auto &kv : parent->children) {
-		const auto &node = kv.second;
-		if (node->kind != CXCursor_FieldDecl || !node->doc_range) {
-			continue;
-		}
-		auto comment = parse_comment(node->doc_range.value());
-		append("* `%s`  %s\n", node->name.c_str(), comment.c_str());
-		has_fields = true;
-	}
-	if (!has_fields) {
-		compiled.pop_back();
-		return;
-	}
-	append("\n");
-}
+	// Starts a render. Everything cached is dropped if the renderers or
+	// the options they use changed since the last one.
+	void begin(uint64_t render_hash);
 
-const std::vector<std::string> &Header::build() {
-	append("# %s\n\n", filename.c_str());
-	build(declarations, 0);
+	// Section from the previous render, nullptr if there was none.
+	Fragment *find(const std::string &key);
 
-	if (options.build_toc) {
-		std::vector<std::string> toc;
-		build_toc(toc, declarations, 0);
-		toc.push_back("\n---\n\n");
-		compiled.insert(compiled.begin() + 1, toc.begin(), toc.end());
-	}
-	return compiled;
-}
+	// Section of the current render, rendered or reused.
+	void add(const std::string &key, Fragment &&fragment);
 
-void Header::build_toc(std::vector<std::string> &toc,
-                       NodeMap &declmap, int depth) const {
-	static char buffer[512];
-	for (const auto &kv : declmap) {
-		const auto &node = kv.second;
-		if (!node->doc_range && !iscontainer(node->kind)) {
-			continue;
-		}
+	// Ends a render, sections that weren't part of it are dropped.
+	void end();
 
-		if (node->kind == CXCursor_FieldDecl) {
-			// Cannot have a link to a member variable
-			continue;
-		}
+	bool load(const std::string &path);
+	bool save(const std::string &path) const;
 
-		auto kstr = decl_str(node->kind);
-		if (kstr == nullptr || node->name == "") {
-			continue;
-		}
-		auto link = std::string{kstr} + "-" + node->qualified_name;
-		auto n = sprintf(buffer, "%s* [%s](#%s)\n",
-		                 std::string(depth*4, ' ').c_str(),
-		                 node->name.c_str(),
-		                 link.c_str());
-		buffer[n] = '\0';
-		toc.emplace_back(std::string{buffer});
-		if (node->children.size() > 0) {
-			build_toc(toc, node->children, depth + 1);
-		}
-	}
-}
+	size_t reused = 0;
+	size_t rendered = 0;
 
-void Header::build(NodeMap &declmap, int depth) {
-	for (const auto &kv : declmap) {
-		auto &node = kv.second;
-		auto kstr = decl_str(node->kind);
+private:
+	uint64_t render_hash = 0;
+	std::unordered_map<std::string, Fragment> previous;
+	std::unordered_map<std::string, Fragment> current;
+};
 
-		if (kstr == nullptr) {
-			// Non printable declaration
-			continue;
-		}
+class Header {
+public:
+	std::string filename;
 
-		if (!options.include_private && node->access == CX_CXXPrivate) {
-			continue;
-		}
+	Header(const std::string &filename,
+	       Source &&source, Options opt);
+
+	// from_disk is set when libclang read the header itself rather than
+	// its stripped text, lines are then mapped back to the stripped text.
+	void parse(CXTranslationUnit tu, bool from_disk = false);
+
+	// Parses several headers from one translation unit that includes
+	// them all, read from disk. Each declaration goes to the header it
+	// is written in, declarations from any other file are skipped.
+	static void parse(CXTranslationUnit tu,
+	                  const std::vector<Header *> &headers);
+
+	// Builds the declaration tree from tokens alone, without libclang.
+	// Returns false, leaving the header empty, if the source uses a
+	// construct the scanner doesn't understand.
+	bool parse_fast();
+
+	// Renders the header with each renderer in one walk. Top level
+	// sections that are unchanged since the render cached in cache are
+	// copied from it.
+	void render(const std::vector<Renderer *> &renderers,
+	            FragmentCache *cache = nullptr);
+
+	// Declaration database, the parsed tree of a header cached in a
+	// binary file so it can be rendered again without libclang. Loading
+	// fails if the file was saved from other contents or parse options.
+	bool load(const std::string &path, uint64_t parse_hash);
+	bool save(const std::string &path, uint64_t parse_hash) const;
+
+	std::string_view text() const;
+
+	void insert(const CXCursor &cursor, Node &&node);
+	void insert(Node &&node, std::optional<QualifiedName> container);
+	Node *find(QualifiedName name);
+
+	// Children of a node in declaration order, and sorted by
+	// qualified name. Only valid once the header is parsed.
+	NodeList children(const Node &node) const;
+	NodeList sorted_children(const Node &node) const;
 
-		auto [line_start, line_end] = node->decl_range;
-
-		// Checking if start != end ensures we don't try to add children
-		// to a one line declaration. For example take 'enum Enum {A, B};',
-		// since the child declarations already appear on the same line
-		// where the parent was declared we don't want to include them again.
-		if (iscontainer(node->kind) && line_start != line_end) {
-			auto formatted = parse_source(line_start, line_end, 0);
-
-			auto pre = depth == 0 ? "##" : "###";
-			append("%s %s `%s`\n\n", pre, kstr, node->qualified_name.c_str());
-			append("```cpp\n");
-			append("%s {\n", formatted.c_str());
-			append_child_nodes(node, 4);
-			append("};\n");
-			append("```\n");
-
-			// Containers with children are never excluded whether
-			// they have comments or not
-			if (node->doc_range) {
-				auto comment = parse_comment(node->doc_range.value());
-				append("%s\n\n", comment.c_str());
-				comment.clear();
-			}
+	std::string parse_source(unsigned start, unsigned end, int indent) const;
+	std::string parse_comment(const SourceRange &range) const;
 
-			append_fields(node);
-			build(node->children, depth + 1);
+private:
+	unsigned source_line(unsigned line) const;
 
-			if (depth == 0) {
-				append("\n---\n\n");
-			}
-			continue;
+	template<typename Route>
+	static void visit(CXTranslationUnit tu, Route &route);
+	CXChildVisitResult visit(const CXCursor &cursor, CXCursorKind kind,
+	                         CXChildVisitResult next);
+	void finish_parse();
+
+	std::optional<SourceRange> find_doc(unsigned linenum) const;
+	std::optional<SourceRange> attached_doc(const CXCursor &cursor,
+	                                        unsigned linenum) const;
+
+	void remove_children(NodeId id);
+	void link_children();
+	void clear();
+
+	void format_members(const Node &parent, int indent);
+	void format_fields(const Node &parent);
+
+	bool renderable(const Node &node, bool &container) const;
+	void section_hash(const Node &node, uint64_t &content,
+	                  uint64_t &lines) const;
+
+	void render_sections(const std::vector<Renderer *> &renderers,
+	                     FragmentCache *cache);
+	void render(const std::vector<Renderer *> &renderers,
+	            const Node &parent, int depth);
+	void render_decl(const std::vector<Renderer *> &renderers,
+	                 const Node &node, int depth, bool container);
+	void render_toc(const std::vector<Renderer *> &renderers,
+	                const Node &parent, int depth);
+
+	template<typename... Args>
+	void log(const char *fmt, Args... args);
+
+	void flush_log();
+
+	// Scratch space reused for every rendered declaration
+	Buffer code;
+	std::vector<RenderField> fields;
+
+	Buffer log_buffer;
+	Source source;
+
+	// All declarations of the header, nodes[RootNode] stands in for the
+	// translation unit. Children are listed per node as a range of
+	// child_ids (declaration order) and sorted_ids (qualified name order).
+	std::vector<Node> nodes;
+	std::vector<NodeId> child_ids;
+	std::vector<NodeId> sorted_ids;
+
+	// Every node in the declaration tree by qualified name, so parents
+	// can be found without walking the tree.
+	std::unordered_map<QualifiedName, NodeId, Name::Hash> index;
+
+	QualifiedNameCache names;
+	Options options;
+	size_t cursors_visited = 0;
+	// Whether the parsed lines are those of the file on disk
+	bool from_disk = false;
+
+	friend class FastParser;
+	// Microbenchmarks in bench/ time private lookups on their own
+	friend class HeaderBench;
+};
+
+template<typename... Args>
+void Header::log(const char *fmt, Args... args) {
+	log_buffer.append(fmt, args...);
+}
+
+// Walks the translation unit once, route maps a cursor's location to
+// the header it belongs to, or nullptr to skip the cursor.
+template<typename Route>
+void Header::visit(CXTranslationUnit tu, Route &route) {
+	auto tu_cursor = clang_getTranslationUnitCursor(tu);
+	clang_visitChildren(tu_cursor, [](auto cursor, auto, auto cdata) {
+		auto &route = *reinterpret_cast<Route *>(cdata);
+		auto kind = clang_getCursorKind(cursor);
+
+		// Only scopes are entered, everything else (expressions,
+		// parameters, template arguments, ...) can't contain a
+		// declaration that would be documented.
+		auto next = isscope(kind) ? CXChildVisit_Recurse
+		                          : CXChildVisit_Continue;
+		if (!isdecl(kind) && !isscope(kind)) {
+			return CXChildVisit_Continue;
 		}
-		if (node->doc_range && node->kind != CXCursor_FieldDecl) {
-			auto comment = parse_comment(node->doc_range.value());
-			// Only declarations that have comments will be documented
-			append_decl(depth == 0 ? "##" : "###", kstr, node);
-			append("%s\n\n", comment.c_str());
-			comment.clear();
+		Header *self = route(clang_getCursorLocation(cursor));
+		if (self == nullptr) {
+			return CXChildVisit_Continue;
 		}
-	}
+		return self->visit(cursor, kind, next);
+	}, &route);
 }
 
-bool build_docs(const std::string &filename, Options options) {
-	auto safe_name = [](std::string path) {
-		std::replace(path.begin(), path.end(), '/', '_');
-		std::replace(path.begin(), path.end(), '\\', '_');
-		return path;
+// 64-bit FNV-1a, used to detect changes to inputs and outputs.
+uint64_t hash_bytes(const char *data, size_t size,
+                    uint64_t hash = 0xcbf29ce484222325);
+
+// Hash of the options that affect which declarations are parsed from a
+// header, as opposed to how they are rendered.
+uint64_t parse_hash(const std::string &filename, const Options &options,
+                    const std::vector<std::string> *arguments = nullptr);
+
+// Hash of everything besides the input contents that affects the
+// output written for a header.
+uint64_t options_hash(const std::string &filename, const Options &options,
+                      const std::vector<std::string> *arguments = nullptr);
+
+// Records the input and options hash each output file was last built
+// from, stored in the output directory. Inputs that match their entry
+// are skipped without being parsed. Safe to update from multiple workers.
+class Manifest {
+public:
+	struct Entry {
+		uint64_t input_hash;
+		uint64_t options_hash;
 	};
 
-	std::vector<std::string> source;
-	auto tmp_header = "dsdoc_tmp_" + safe_name(filename);
-	std::ifstream infile{filename};
-	std::ofstream outfile{tmp_header};
-
-	std::string line;
-	std::string lncpy;
-	while (std::getline(infile, line)) {
-		lncpy = line;
-		ltrim(lncpy, ' ', '\t');
-		if (lncpy.size() > 0 && lncpy[0] == '#') {
-			// Ideally this step is not necessary but libclang
-			// doesn't seem to traverse files with lots of includes.
-			continue;
-		}
-		outfile << line << '\n';
-		source.push_back(line);
-	}
-	outfile.close();
+	static constexpr const char *Filename = ".pocdoc-manifest";
 
-	const char *args[] = {"-x", "c++", 0};
-	auto index = clang_createIndex(0, 0);
+	void load(const std::string &output_dir);
+	bool save() const;
 
-	auto tu = clang_parseTranslationUnit(
-		index, tmp_header.c_str(),
-		args, (sizeof(args) / sizeof(*args)) - 1,
-		nullptr, 0,
-		CXTranslationUnit_SkipFunctionBodies);
+	bool unchanged(const std::string &output, const Entry &entry) const;
+	void update(const std::string &output, const Entry &entry);
+	void remove(const std::string &output);
 
-	std::remove(tmp_header.c_str());
-	if (tu == nullptr) {
-		return false;
-	}
+private:
+	mutable std::mutex mutex;
+	std::string path;
+	std::map<std::string, Entry> entries;
+	bool dirty = false;
+};
 
-	auto out_filename = safe_name(filename);
-	if (options.trim_path_prefix != "") {
-		auto trim_pos = filename.find(options.trim_path_prefix);
-		if (trim_pos != std::string::npos) {
-			out_filename.erase(trim_pos, options.trim_path_prefix.size());
-		}
-	}
+// Writes the output to path unless the file already holds the exact
+// same bytes, so tools watching the output directory only see real
+// changes. Both segments are written with a single writev.
+bool write_output(const std::string &path, const Output &output);
+
+// On disk layout of a declaration database, in native byte order. The
+// header is followed by the nodes, the child lists (declaration order,
+// then sorted), and NUL terminated names. Every section is 4 byte
+// aligned so the file can be used straight from a mapping.
+struct DbHeader {
+	static constexpr char Magic[4] = {'P', 'D', 'B', '\0'};
+	static constexpr uint32_t Version = 1;
+
+	char magic[4];
+	uint32_t version;
+	uint64_t input_hash;
+	uint64_t parse_hash;
+	uint32_t node_count;
+	uint32_t child_count;
+	uint32_t line_count;
+	uint32_t string_size;
+};
 
-	Header header{filename, std::move(source), options};
-	header.parse(tu);
+struct DbNode {
+	uint32_t name;
+	uint32_t qualified_name;
+	int32_t kind;
+	uint32_t access;
+	uint32_t decl_start, decl_end;
+	uint32_t has_doc;
+	uint32_t doc_start, doc_end;
+	uint32_t parent;
+	uint32_t children_begin, children_end;
+};
 
-	out_filename += ".md";
-	if (options.output_dir != "") {
-		out_filename = options.output_dir + "/" + out_filename;
-	}
+Source read_source(const std::string &filename);
+
+// Source of a header held in memory, contents are copied.
+Source make_source(std::string_view text);
+
+// Parses the stripped contents of a header, or the file on disk with
+// its includes without contents. Empty contents are parsed as an empty
+// header, never read from disk.
+TranslationUnit parse_translation_unit(
+		CXIndex index, const std::string &filename,
+		std::optional<std::string_view> contents, const Options &options,
+		const std::vector<std::string> *arguments = nullptr);
+
+// Reparses a translation unit after its header changed, from contents
+// or from disk without them. On failure the translation unit is
+// disposed as libclang leaves it in an invalid state.
+bool reparse_translation_unit(TranslationUnit &tu,
+                              const std::string &filename,
+                              std::optional<std::string_view> contents);
+
+// Compiler arguments for each header from a compile_commands.json, so
+// headers can be parsed with their includes instead of having every
+// preprocessor line stripped. Headers parsed with the same arguments
+// share a precompiled header made of the union of their <...> includes.
+class CompileCommands {
+public:
+	CompileCommands() = default;
+	~CompileCommands();
+
+	CompileCommands(const CompileCommands &) = delete;
+	CompileCommands &operator=(const CompileCommands &) = delete;
+
+	// Reads compile_commands.json from build_dir and looks up the
+	// arguments for each header, false if there are no commands.
+	// Preambles are written to the output directory.
+	bool load(const std::string &build_dir,
+	          const std::vector<std::string> &filenames,
+	          const Options &options);
+
+	// Arguments from the compilation database, nullptr for unknown
+	// headers. They don't name the preamble, hash these.
+	const std::vector<std::string> *arguments(
+		const std::string &filename) const;
+
+	// Arguments to parse a header with. The preamble shared by the
+	// header's command is built the first time one of them is parsed,
+	// headers that are up to date never pay for it.
+	const std::vector<std::string> *parse_arguments(
+		CXIndex index, const std::string &filename) const;
 
-	std::ofstream md{out_filename};
-	for (const auto &compiled : header.build()) {
-		md << compiled;
-	}
-	return true;
-}
+private:
+	struct Command {
+		std::vector<std::string> arguments;
+		std::vector<std::string> headers;
+	};
+
+	struct Preamble {
+		std::once_flag built;
+		std::string path;
+		// Command arguments with -include-pch when the preamble built
+		std::vector<std::string> arguments;
+	};
+
+	static std::vector<std::string> filter_arguments(
+		CXCompileCommand command, const std::string &directory,
+		const std::string &source);
+
+	bool build_preamble(CXIndex index, const Command &command,
+	                    const std::string &path) const;
+
+	std::vector<Command> commands;
+	// Index into commands
+	std::unordered_map<std::string, size_t> headers;
+	std::unique_ptr<Preamble[]> preambles;
+	std::string output_dir;
+	bool verbose = false;
+};
+
+std::string output_path(const std::string &filename,
+                        const Options &options,
+                        Format format = FormatMarkdown);
+
+// Path of a header's declaration database, empty without a database
+// directory. Unlike output paths it doesn't depend on render options.
+std::string db_path(const std::string &filename, const Options &options,
+                    const char *extension = ".pocdb");
+
+// Renders the header in every requested format from the one parse and
+// writes each next to the others. Without a fragment cache of its own,
+// the header's cached sections are kept in the database directory.
+bool write_outputs(Header &header, const Options &options,
+                   FragmentCache *cache = nullptr);
+
+// Whether the manifest has output for the same input and options, and
+// the output files still exist. Headers are tracked by their markdown
+// path whichever formats are built.
+bool up_to_date(const Manifest *manifest, const std::string &filename,
+                const std::string &output, const Manifest::Entry &entry,
+                const Options &options);
+
+bool load_db(Header &header, const Options &options,
+             const std::vector<std::string> *arguments);
+
+void save_db(const Header &header, const Options &options,
+             const std::vector<std::string> *arguments);
+
+bool build_docs(Index &index, const std::string &filename,
+                Options options, Manifest *manifest = nullptr,
+                const CompileCommands *commands = nullptr);
+
+// Builds several headers from umbrella translation units that include
+// them, so code the headers share is parsed once instead of once per
+// header. Headers are grouped by their compile arguments, each group is
+// one translation unit. Returns the headers that could not be built.
+std::vector<std::string> build_umbrella(
+		Index &index, const std::vector<std::string> &filenames,
+		Options options, Manifest *manifest = nullptr,
+		const CompileCommands *commands = nullptr);
+
+// A header whose translation unit stays alive between builds so edits
+// only cost a reparse. Used by watch mode.
+class Document {
+public:
+	const std::string filename;
+
+	Document(CXIndex index, const std::string &filename, Options options,
+	         const CompileCommands *commands = nullptr)
+		: filename{filename}
+		, index{index}
+		, options{options}
+		, commands{commands}
+		, arguments{commands ? commands->arguments(filename) : nullptr} {}
+
+	// Re-reads the header and, if its contents changed since the last
+	// call, reparses it and rewrites the markdown.
+	bool update();
+
+private:
+	CXIndex index;
+	Options options;
+	const CompileCommands *commands;
+	const std::vector<std::string> *arguments;
+	TranslationUnit tu;
+	std::optional<uint64_t> hash;
+	// Sections of the last build, only the ones an edit touched are
+	// rendered again.
+	FragmentCache fragments;
+};
+
+bool build_docs(const std::string &filename, Options options);
+
+// Parses and renders headers held in memory, for programs that embed
+// pocdoc instead of running it. Contexts are thread safe, render may be
+// called from any number of threads at once. Each parse borrows an idle
+// libclang index from the context, or creates one when all are busy, so
+// parses on different threads run concurrently and indexes are reused
+// by later calls. The lock is only held to borrow and return them.
+class Context {
+public:
+	// Receives the rendered document in order, in one or more parts.
+	using Sink = std::function<void(std::string_view)>;
+
+	explicit Context(const Options &options = {});
+
+	// Renders contents as the header filename, which only names the
+	// document. Like files given to the tool, preprocessor lines are
+	// dropped before parsing. Returns false if libclang couldn't parse
+	// the header.
+	bool render(const std::string &filename, std::string_view contents,
+	            Format format, const Sink &sink);
+	bool render(const std::string &filename, std::string_view contents,
+	            Format format, std::string &out);
+
+private:
+	// Idle libclang indexes. A CXIndex isn't used by two parses at once,
+	// each render takes one so parsing doesn't hold the lock.
+	std::unique_ptr<Index> take_index();
+	void release_index(std::unique_ptr<Index> index);
+
+	Options options;
+	std::mutex mutex;
+	std::vector<std::unique_ptr<Index>> indexes;
+};
 
 } // pocdoc
 
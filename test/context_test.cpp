@@ -0,0 +1,83 @@
+// Copyright (c) 2020 stillwwater
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+// Renders headers held in memory through pocdoc::Context. Contents are
+// always what gets parsed, even when they are empty and a file with the
+// same name exists on disk.
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+#include "../pocdoc.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+	if (!ok) {
+		printf("FAIL %s\n", what);
+		++failures;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	std::string input = argc > 1 ? argv[1] : "test/test.h";
+
+	pocdoc::Context context;
+	std::string expected;
+	check(context.render("missing.h", "", pocdoc::FormatMarkdown, expected),
+	      "empty contents");
+
+	// test.h exists, its declarations must not show up
+	std::string out;
+	check(context.render(input, "", pocdoc::FormatMarkdown, out),
+	      "empty contents of a file on disk");
+	check(out.find("StructDecl") == std::string::npos,
+	      "empty contents read from disk");
+
+	check(context.render("missing.h", "\n\n", pocdoc::FormatMarkdown, out),
+	      "blank contents");
+	check(context.render("missing.h", "// Documented\nint function();\n",
+	                     pocdoc::FormatMarkdown, out)
+	      && out.find("function") != std::string::npos,
+	      "one declaration");
+
+	size_t parts = 0;
+	check(context.render(input, {}, pocdoc::FormatJson,
+	                     [&](std::string_view) { ++parts; }),
+	      "empty contents to a sink");
+
+	// Contents in memory are stripped, umbrella and compilation database
+	// options must not map their lines as if read from disk.
+	std::ifstream file{input};
+	std::ostringstream text;
+	text << file.rdbuf();
+	pocdoc::Options umbrella_options;
+	umbrella_options.umbrella = true;
+	pocdoc::Context umbrella{umbrella_options};
+	check(context.render(input, text.str(), pocdoc::FormatMarkdown, expected)
+	      && umbrella.render(input, text.str(), pocdoc::FormatMarkdown, out)
+	      && out == expected,
+	      "umbrella options on contents in memory");
+
+	if (failures == 0) {
+		printf("context_test: empty contents are not read from disk\n");
+	}
+	return failures > 0;
+}
@@ -0,0 +1,157 @@
+// Copyright (c) 2020 stillwwater
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+// Feeds truncated and corrupted declaration databases to pocdoc. Every
+// one of them must be rejected, and building with it must parse the
+// header again and write the same output as without a database.
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include "../pocdoc.h"
+
+using Bytes = std::vector<char>;
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+	if (!ok) {
+		printf("FAIL %s\n", what);
+		++failures;
+	}
+}
+
+static Bytes read_bytes(const std::string &path) {
+	std::ifstream file{path, std::ios::binary};
+	return Bytes{std::istreambuf_iterator<char>{file}, {}};
+}
+
+static void write_bytes(const std::string &path, const Bytes &bytes) {
+	std::ofstream file{path, std::ios::binary | std::ios::trunc};
+	file.write(bytes.data(), bytes.size());
+}
+
+static pocdoc::DbNode *record(Bytes &bytes, size_t i) {
+	auto *nodes = reinterpret_cast<pocdoc::DbNode *>(
+		bytes.data() + sizeof(pocdoc::DbHeader));
+	return nodes + i;
+}
+
+// First node with a documentation comment, the root has none.
+static size_t documented(Bytes &bytes) {
+	auto *header = reinterpret_cast<pocdoc::DbHeader *>(bytes.data());
+	for (size_t i = 1; i < header->node_count; ++i) {
+		if (record(bytes, i)->has_doc) {
+			return i;
+		}
+	}
+	return 1;
+}
+
+struct Corruption {
+	const char *name;
+	std::function<void(Bytes &)> apply;
+};
+
+static const Corruption Corruptions[] = {
+	{"truncated header", [](Bytes &b) { b.resize(sizeof(pocdoc::DbHeader) / 2); }},
+	{"truncated nodes", [](Bytes &b) { b.resize(b.size() - 7); }},
+	{"decl_start 0", [](Bytes &b) { record(b, 1)->decl_start = 0; }},
+	{"decl_start after decl_end", [](Bytes &b) {
+		auto *node = record(b, 1);
+		node->decl_start = node->decl_end + 1;
+	}},
+	{"decl_end past the last line", [](Bytes &b) {
+		record(b, 1)->decl_end = 0xFFFFFFFF;
+	}},
+	{"doc_end wraps", [](Bytes &b) {
+		record(b, documented(b))->doc_end = 0xFFFFFFFF;
+	}},
+	{"doc_end on the line count", [](Bytes &b) {
+		auto *header = reinterpret_cast<pocdoc::DbHeader *>(b.data());
+		record(b, documented(b))->doc_end = header->line_count;
+	}},
+	{"doc_start after doc_end", [](Bytes &b) {
+		auto *node = record(b, documented(b));
+		node->doc_start = node->doc_end + 1;
+	}},
+	{"doc_start past the last line", [](Bytes &b) {
+		record(b, documented(b))->doc_start = 0x7FFFFFFF;
+	}},
+	{"kind out of range", [](Bytes &b) { record(b, 1)->kind = -1; }},
+	{"parent out of range", [](Bytes &b) { record(b, 1)->parent = 0x7FFFFFFF; }},
+	{"name out of range", [](Bytes &b) { record(b, 1)->name = 0x7FFFFFFF; }},
+};
+
+int main(int argc, char *argv[]) {
+	std::string input = argc > 1 ? argv[1] : "test/test.h";
+
+	char dir[] = "/tmp/pocdoc-db-test-XXXXXX";
+	if (mkdtemp(dir) == nullptr) {
+		printf("FAIL could not create a temporary directory\n");
+		return 1;
+	}
+	pocdoc::Options options;
+	options.build_toc = true;
+	options.output_dir = dir;
+	options.db_dir = dir;
+	auto db = pocdoc::db_path(input, options);
+	auto output = pocdoc::output_path(input, options);
+
+	pocdoc::Index index;
+	check(pocdoc::build_docs(index, input, options), "first build");
+	auto expected = read_bytes(output);
+	auto saved = read_bytes(db);
+	check(!saved.empty(), "database written");
+	if (failures > 0) {
+		return 1;
+	}
+
+	auto hash = pocdoc::parse_hash(input, options);
+	for (const auto &corruption : Corruptions) {
+		auto bytes = saved;
+		corruption.apply(bytes);
+		write_bytes(db, bytes);
+
+		pocdoc::Header header{input, pocdoc::read_source(input), options};
+		check(!header.load(db, hash), corruption.name);
+
+		// Building again must parse the header and replace the database
+		unlink(output.c_str());
+		check(pocdoc::build_docs(index, input, options), corruption.name);
+		check(read_bytes(output) == expected, corruption.name);
+		check(read_bytes(db) == saved, corruption.name);
+	}
+
+	unlink(output.c_str());
+	unlink(db.c_str());
+	unlink(pocdoc::db_path(input, options, ".pocfrag").c_str());
+	rmdir(dir);
+	if (failures == 0) {
+		printf("db_test: %zu corrupted databases rejected\n",
+		       std::size(Corruptions));
+	}
+	return failures > 0;
+}